@@ -10,29 +10,75 @@
 
 #include "bulk_cypress.h"
 #include "brl_usb_fops.h"
+#include "brl_usb_trace.h"
+#ifdef BRL_USB_URING
+#include <linux/io_uring/cmd.h>
+#endif
 
-extern struct usb_cypress_node USBBoards[];
 extern struct usb_driver cypress_driver;
 
+/* Upper bound on how long a blocking read() sleeps for its urb, in us. 0 = no limit. */
+static unsigned int read_timeout_us = 0;
+module_param(read_timeout_us, uint, 0644);
+MODULE_PARM_DESC(read_timeout_us, "Blocking read() timeout in microseconds (0 = wait for completion)");
+
+/* How long a board reset waits for the board's ack, in us. 0 = no limit. */
+static unsigned int reset_timeout_us = 100000;
+module_param(reset_timeout_us, uint, 0644);
+MODULE_PARM_DESC(reset_timeout_us, "Board reset ack timeout in microseconds (default 100000, 0 = wait for the ack)");
+
 struct usb_cypress *getDev(struct inode * inode){
   struct usb_interface *iface = usb_find_interface(&cypress_driver,iminor(inode));
-  return usb_get_intfdata(iface);
+  return iface ? usb_get_intfdata(iface) : NULL;
+}
+
+/* claim_read() / release_read()
+ *    - arbitrate read_urb between the open files of a board.  A client
+ *  owns it from ioctl(4) or XFER until it has collected the reply, so
+ *  another client cannot overwrite rt_buffer or read_actual_length.
+ *  Releasing also consumes a completed result, before ownership is
+ *  dropped so it cannot be the next owner's.
+ */
+static int claim_read(struct usb_cypress *dev, void *owner)
+{
+  void *cur = cmpxchg(&dev->read_owner, NULL, owner);
+
+  return (cur == NULL || cur == owner) ? 0 : -EBUSY;
+}
+
+static void release_read(struct usb_cypress *dev, void *owner)
+{
+  if (READ_ONCE(dev->read_owner) != owner)
+    return;
+  cypress_read_consume(dev);
+  cmpxchg(&dev->read_owner, owner, NULL);
 }
 
 /* Begin: Test File Operations */
 int test_open(struct inode *inode, struct file *pfile)
 {
-  int ret = 0;
   struct usb_cypress *dev = getDev(inode);
-  pfile->private_data = dev;
-  dev->boardSerialNum = getSerialNum(dev);
-  printk("test open (%d)\n", dev->boardSerialNum);
+  struct brl_usb_client *client;
 
-  if (ret == 0) {
-    atomic_set( &dev->fs_operable, 1);
-    atomic_set( &dev->fs_read_busy, 0 );
-  }
-  return ret;
+  if (dev == NULL)
+    return -ENODEV;
+
+  // copy_record() sends in_record and in_buffer with one copy_to_user()
+  BUILD_BUG_ON(offsetof(struct brl_usb_client, in_buffer) !=
+	       offsetof(struct brl_usb_client, in_record) + sizeof(struct brl_usb_record));
+
+  client = kzalloc(sizeof(*client), GFP_KERNEL);
+  if (client == NULL)
+    return -ENOMEM;
+  client->dev = dev;
+  mutex_init(&client->io_mutex);
+  kref_get(&dev->kref);                       // dev outlives a disconnect until close()
+
+  pfile->private_data = client;
+  pfile->f_mode |= FMODE_NOWAIT;              // read_iter/write_iter honour IOCB_NOWAIT
+  atomic_inc(&dev->open_count);
+  cypress_log("test open (%d), %d open\n", dev->boardSerialNum, atomic_read(&dev->open_count));
+  return 0;
 }
 
 /*  test_read()
@@ -46,254 +92,1059 @@ ssize_t test_read(struct file *pfile,
 			 loff_t *ppos)
 {
   /* TODO: put mutex on read for each board serial */
-  int i,   readLen = count;
-  int result[8] = {0,0,0,0,0,0,0};
-  int channel=0;
-  unsigned char readBuffer[count];
+  int readLen = min(count, (size_t)USB_MAX_IN_LEN);
   size_t bytesRead=0;
   int ret;
-  struct usb_cypress *dev = (struct usb_cypress*) pfile->private_data;
-  int serial = dev->boardSerialNum;
-  if(!atomic_read(&dev->fs_operable))
-    return -ENOSPC;
-  atomic_set( &dev->fs_read_busy, 1 );
+  struct brl_usb_client *client = pfile->private_data;
+  struct usb_cypress *dev = client->dev;
+  unsigned char *readBuffer = client->in_buffer;   // ours while we hold read_owner
+  if (claim_read(dev, client))
+    return -EBUSY;
 
-  dev->read_task = current;
-  set_current_state(TASK_INTERRUPTIBLE);
-  memset(readBuffer,0x00,count);
+  memset(readBuffer,0x00,USB_MAX_IN_LEN);
 
   // Initiate USB read
-  ret = cypress_request_read( serial, readBuffer, readLen );
+  ret = cypress_submit_read( dev, readBuffer, readLen, NULL, NULL );
   if (ret < 0 ){
-    printk("Error requesting read: %d\n",ret);
+    cypress_log("Error requesting read: %d\n",ret);
+    goto exit;
   }
 
   // Wait for USB callback to execute/finish.	
-  // TODO: This timeout is too long (ms resolution).  Find high-res version
-  // TODO: Wake this process from cypress_read_callback
-  ret = schedule_timeout( 10 );
+  if (ret == 0) {
+    ret = cypress_wait_read(dev, read_timeout_us);
+    if (ret < 0) {
+      usb_kill_urb(dev->read_urb);     // urb must not land in readBuffer after we return
+      goto exit;
+    }
+  }
 
-  // Check for usb read completion
-  bytesRead = cypress_get_bytes_read(serial);
+  // Check for usb read completion; the board may be gone by now, so
+  // don't look it up by serial again
+  bytesRead = min_t(size_t, READ_ONCE(dev->read_actual_length), readLen);
   if (bytesRead <= 0) {
-    printk("Cypress read failed: No data (%zd)!\n", bytesRead);
+    cypress_log("Cypress read failed: No data (%zd)!\n", bytesRead);
     ret = -ENODEV;
     goto exit;
   }
   ret = bytesRead;
   
   // Copy data to userspace
-  for (i=0; i<bytesRead; i++) {
-    put_user( readBuffer[i], userBuffer+i);
+  if (copy_to_user(userBuffer, readBuffer, bytesRead)) {
+    ret = -EFAULT;
+    goto exit;
   }
 
-
-  for (channel=0; channel<8;channel++)
-  {
-	  result[channel] = (readBuffer[3*channel+5]<<16) | (readBuffer[3*channel+4]<<8) | (readBuffer[3*channel+3]);
-  }
+  // the encoder counts are decoded by the read callback, see BRL_USB_READ_DECODED
 
  exit:
-  atomic_set( &dev->fs_read_busy, 0 );
+  release_read(dev, client);
   return ret;
 }
 
 
 
+/* packet_room()
+ *    - how much of the caller's buffer the next packet may use.  readv()
+ *  and writev() carry one packet per iovec, so that is the rest of the
+ *  current iovec; a plain read()/write() has a single one.
+ */
+static size_t packet_room(const struct iov_iter *iter)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+  return user_backed_iter(iter) ? iter_iov_len(iter) : iov_iter_count(iter);
+#else
+  return iov_iter_single_seg_count(iter);
+#endif
+}
+
+static int iocb_nonblock(const struct kiocb *iocb)
+{
+  return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/* read_stream_data()
+ *    - read() handler while the board is streaming or in the cycle engine.
+ *  Returns the oldest packet in the stream ring, sleeping until one arrives,
+ *  or 0 once the producer has stopped and the ring is drained.  more is set
+ *  for the later packets of a batch: those never sleep, and in decoded mode
+ *  a packet without encoders ends the batch and stays in the ring.
+ */
+static ssize_t read_stream_data(struct brl_usb_client *client,
+				struct iov_iter *to,
+				size_t count,
+				int nonblock,
+				int more)
+{
+  struct usb_cypress *dev = client->dev;
+  struct {
+    struct brl_usb_record hdr;
+    unsigned char data[USB_MAX_IN_LEN];
+  } packet;
+  struct brl_usb_encoders enc;
+  int record = client->read_format == BRL_USB_READ_RECORD;
+  int decoded = client->read_format == BRL_USB_READ_DECODED;
+  size_t hdr_len = record ? sizeof(packet.hdr) : 0;
+  ssize_t len;
+  int ret;
+
+  if (count < (decoded ? sizeof(enc) : hdr_len))
+    return -EINVAL;
+  // a zero-length raw read must not pop (and lose) a packet
+  if (!decoded && !record && count == 0)
+    return 0;
+
+  if (!cypress_stream_pending(dev))
+    {
+      if (nonblock || more)
+	return -EAGAIN;
+      ret = cypress_wait_stream(dev, read_timeout_us);
+      if (ret < 0)
+	return ret;
+      // woken without a packet: streaming or the cycle engine stopped
+      if (!cypress_stream_pending(dev))
+	return 0;
+    }
+
+  if (decoded)
+    {
+      len = cypress_stream_pop(dev, NULL, 0, NULL, &enc);
+      if (len == -ENODATA && !more)
+	cypress_stream_pop(dev, packet.data, 0, NULL, NULL);   // drop it, or we'd never get past it
+      if (len < 0)
+	return len;
+      if (copy_to_iter(&enc, sizeof(enc), to) != sizeof(enc))
+	return -EFAULT;
+      client->stats.reads++;
+      client->stats.read_bytes += sizeof(enc);
+      return sizeof(enc);
+    }
+
+  len = cypress_stream_pop(dev, packet.data, min(count - hdr_len, sizeof(packet.data)),
+			   record ? &packet.hdr : NULL, NULL);
+  if (len < 0)
+    return len;
+
+  // the header, if any, is directly followed by the payload: one copy
+  if (copy_to_iter(record ? (void *)&packet : (void *)packet.data, hdr_len + len, to) != hdr_len + len)
+    return -EFAULT;
+  trace_brl_usb_copy_out(dev->boardSerialNum, len, len ? packet.data[0] : 0, 0);
+  client->stats.reads++;
+  client->stats.read_bytes += len;
+  return hdr_len + len;
+}
+
+/* read_stream_iter()
+ *    - drain up to one queued packet per iovec.  Only the first packet
+ *  may sleep; after that we return what is already queued.  The batch
+ *  ends after a packet shorter than its iovec, so the caller can always
+ *  tell from the return value where each packet starts.
+ */
+static ssize_t read_stream_iter(struct brl_usb_client *client,
+				struct iov_iter *to,
+				int nonblock)
+{
+  ssize_t total = 0;
+  ssize_t ret;
+  size_t room;
+
+  do
+    {
+      room = packet_room(to);
+      ret = read_stream_data(client, to, room, nonblock, total != 0);
+      if (ret < 0)
+	return total ? total : ret;
+      total += ret;
+    }
+  while (room && ret == room && iov_iter_count(to));
+
+  return total;
+}
+
+/* read_min_count()
+ *    - smallest read() this file's read format can return a reply in.
+ */
+static size_t read_min_count(const struct brl_usb_client *client)
+{
+  switch (client->read_format)
+    {
+    case BRL_USB_READ_RECORD:
+      return sizeof(struct brl_usb_record);
+    case BRL_USB_READ_DECODED:
+      return sizeof(struct brl_usb_encoders);
+    default:
+      return 0;
+    }
+}
+
+/* copy_record()
+ *    - BRL_USB_READ_RECORD: fill in the header for the reply sitting in
+ *  in_buffer and hand header and payload to userspace in a single copy.
+ *  read_get_data() has checked that count holds the header.
+ */
+static ssize_t copy_record(struct brl_usb_client *client, struct iov_iter *to,
+			   size_t count, size_t bytesRead)
+{
+  struct usb_cypress *dev = client->dev;
+  struct brl_usb_record *rec = &client->in_record;
+  size_t len;
+
+  rec->serial = dev->boardSerialNum;
+  rec->seq = dev->read_stamp.seq;
+  rec->timestamp_ns = dev->read_stamp.ns;
+  rec->actual_length = bytesRead;
+  rec->status = dev->read_status;
+  rec->frame = dev->read_stamp.frame;
+  rec->reserved = 0;
+
+  len = sizeof(*rec) + min(bytesRead, count - sizeof(*rec));
+  if (copy_to_iter(rec, len, to) != len)
+    return -EFAULT;
+  return len;
+}
+
+/* copy_encoders()
+ *    - BRL_USB_READ_DECODED: hand out the positions the read callback
+ *  decoded from the reply, or -ENODATA if it was not an encoder packet.
+ */
+static ssize_t copy_encoders(struct brl_usb_client *client, struct iov_iter *to)
+{
+  struct usb_cypress *dev = client->dev;
+  struct brl_usb_encoders enc;
+
+  if (dev->read_status || !dev->read_decoded)
+    return -ENODATA;
+
+  enc.serial = dev->boardSerialNum;
+  enc.seq = dev->read_stamp.seq;
+  enc.timestamp_ns = dev->read_stamp.ns;
+  enc.frame = dev->read_stamp.frame;
+  enc.reserved = 0;
+  memcpy(enc.position, dev->read_position, sizeof(enc.position));
+  if (copy_to_iter(&enc, sizeof(enc), to) != sizeof(enc))
+    return -EFAULT;
+  return sizeof(enc);
+}
+
 /* read_get_data()
- *    - This is the file read() handler.  
+ *    - This is the file read_iter() handler.  
  *
- *    NOTE::: ioctl(4) must be called before this function.  Otherwise there will
- *  be no data to read!!!
+ *    NOTE::: ioctl(4) must be called on the same open file before this
+ *  function.  Otherwise there will be no data to read!!!
  *
+ *  If the read urb is still in flight we sleep until the read callback wakes
+ *  us, bounded by the read_timeout_us module parameter, or return -EAGAIN
+ *  under O_NONBLOCK / IOCB_NOWAIT.  While streaming or cycling a readv()
+ *  returns several queued packets, see read_stream_iter().
  */
-ssize_t read_get_data(struct file *pfile, 
-			 char *userBuffer, 
-			 size_t count,
-			 loff_t *ppos)
+ssize_t read_get_data(struct kiocb *iocb, struct iov_iter *to)
 {
   size_t bytesRead=0;
-  int i;
-  struct usb_cypress *dev = (struct usb_cypress*) pfile->private_data;
+  size_t count = packet_room(to);
+  ssize_t ret;
+  struct brl_usb_client *client = iocb->ki_filp->private_data;
+  struct usb_cypress *dev = client->dev;
   int serial = dev->boardSerialNum;
 
-  if ( !atomic_read( &dev->fs_read_busy ) )
+  if ( cypress_ring_active( dev ) )
     {
-      printk("read fail(%d): call ioctl first\n", serial);
+      return read_stream_iter(client, to, iocb_nonblock(iocb));
+    }
+
+  if ( READ_ONCE( dev->read_owner ) != client )
+    {
+      cypress_log("read fail(%d): call ioctl first\n", serial);
       //      return test_read(pfile, userBuffer, count, ppos);
       return -ENODEV;
     }
 
-  else if ( atomic_read( &dev->read_busy) )
+  // refuse a buffer that can't take the reply before it is consumed
+  if ( count < read_min_count( client ) )
+    return -EINVAL;
+  if ( count == 0 )
+    return 0;
+
+  if ( cypress_read_busy( dev ) )
     {
-      printk("readbusy on %d in read_get_data (%d)\n", serial, -EBUSY);
-      return -EBUSY;
+      // Wait for the read callback.  On timeout, or if the caller would
+      // rather not wait, the urb stays queued, so a later read() can
+      // still collect it.
+      if (iocb_nonblock(iocb))
+	return -EAGAIN;
+      ret = cypress_wait_read(dev, read_timeout_us);
+      if (ret < 0)
+	return ret;
     }
 
+  // Check for usb read completion.  Not by serial: after an unplug that
+  // would be -ENODEV, and in_buffer holds no more than USB_MAX_IN_LEN.
+  bytesRead = min_t(size_t, READ_ONCE(dev->read_actual_length), USB_MAX_IN_LEN);
 
-  if(!atomic_read(&dev->fs_operable))
+  // a record reports failed transfers through its status field
+  if (client->read_format != BRL_USB_READ_RAW)
     {
-      return -ENODEV;
+      if (client->read_format == BRL_USB_READ_DECODED)
+	ret = copy_encoders(client, to);
+      else
+	ret = copy_record(client, to, count, bytesRead);
+      if (ret < 0 || dev->read_status)
+	client->stats.errors++;
+      else
+	{
+	  client->stats.reads++;
+	  client->stats.read_bytes += bytesRead;
+	}
+      goto exit;
     }
 
-  // Check for usb read completion
-  bytesRead = cypress_get_bytes_read(serial);
   if (bytesRead <= 0) {
-    printk("Cypress read_get failed readbusy?: %d: No data (%zd)!\n", 
-	   (int)atomic_read(&dev->read_busy), 
+    cypress_log("Cypress read_get failed readbusy?: %d: No data (%zd)!\n", 
+	   atomic_read(&dev->read_state), 
 	   bytesRead);
-    bytesRead = -EDEADLK;
+    ret = -EDEADLK;
+    client->stats.errors++;
     goto exit;
   }
   
-  // Copy data to userspace
-  for (i=0; i<bytesRead; i++) {
-    put_user( (dev->rt_buffer)[i], userBuffer+i);
+  // Copy data to userspace, no more than the caller asked for
+  ret = min(bytesRead, count);
+  if (copy_to_iter(client->in_buffer, ret, to) != ret) {
+    ret = -EFAULT;
+    client->stats.errors++;
+    goto exit;
   }
+  client->stats.reads++;
+  client->stats.read_bytes += ret;
   
  exit:
-  kfree(dev->rt_buffer); 
-  atomic_set( &dev->fs_read_busy, 0 );
-  return bytesRead;
+  trace_brl_usb_copy_out(serial, ret > 0 ? ret : 0,
+			 ret > 0 ? client->in_buffer[0] : 0,
+			 ret < 0 ? (int)ret : 0);
+  release_read(dev, client);
+  return ret;
+}
+
+/* write_mailbox()
+ *    - write() in BRL_USB_WRITE_MAILBOX mode.  Called with io_mutex held;
+ *      stages in out_buffer, which cypress_queue_mailbox() copies from.
+ */
+static ssize_t write_mailbox(struct brl_usb_client *client, struct iov_iter *from, size_t count)
+{
+  struct usb_cypress *dev = client->dev;
+  unsigned char *packet = client->out_buffer;
+  ssize_t ret;
+
+  if (copy_from_iter(packet, count, from) != count)
+    return -EFAULT;
+
+  ret = cypress_queue_mailbox(dev, packet, count);
+  trace_brl_usb_write(dev->boardSerialNum, count, packet[0], ret < 0 ? ret : 0);
+  if (ret < 0)
+    {
+      client->stats.errors++;
+      return ret;
+    }
+  client->stats.writes++;
+  client->stats.write_bytes += count;
+  return count;
 }
 
-ssize_t test_write(struct file *pfile, 
-			  const char *in_buffer,
-			  size_t length, 
-			  loff_t *poffset)
+/* write_packet()
+ *    - queue one packet of cpy_len bytes taken from the iterator.
+ */
+static ssize_t write_packet(struct brl_usb_client *client, struct iov_iter *from,
+			    size_t cpy_len, int nonblock)
 {
-  /* TODO: put mutex on write for each board serial */
-  size_t cpy_len = min(length,(size_t)USB_MAX_OUT_LEN);
   int ret = 0;
-  static char writebuff[USB_MAX_OUT_LEN];
-  struct usb_cypress *dev = (struct usb_cypress*) pfile->private_data;
+  struct usb_cypress *dev = client->dev;
   int serial= dev->boardSerialNum;
 
-  if(!atomic_read(&dev->fs_operable))
-    return -ENOSPC;
+  // this file's staging buffer; cypress_queue_write() copies it into a queued urb
+  if (nonblock)
+    {
+      if (!mutex_trylock(&client->io_mutex))
+	return -EAGAIN;
+    }
+  else if (mutex_lock_interruptible(&client->io_mutex))
+    return -ERESTARTSYS;
+
+  if (client->write_mode == BRL_USB_WRITE_MAILBOX)
+    {
+      ret = write_mailbox(client, from, cpy_len);
+      mutex_unlock(&client->io_mutex);
+      return ret;
+    }
 
   // copy from user to kernel
-  ret = copy_from_user(writebuff, in_buffer, cpy_len);
-  if (ret != 0) {
-    printk("copied partial data from userspace\n");
-    return cpy_len - ret;
+  if (copy_from_iter(client->out_buffer, cpy_len, from) != cpy_len) {
+    mutex_unlock(&client->io_mutex);
+    cypress_log("copied partial data from userspace\n");
+    return -EFAULT;
   }
 
-  // check that we're clear to write (not busy)
-  if (atomic_read(&dev->write_busy))
+  // send to USB, waiting for a free write urb unless nonblocking
+  for (;;)
     {
-      printk("Write op failed (writebusy)\n");
-      return -EBUSY;
+      ret = cypress_queue_write(dev, client->out_buffer, cpy_len, NULL, NULL);
+      if (ret != -EBUSY)
+	break;
+      if (nonblock)
+	{
+	  atomic_long_inc(&dev->errors[CYPRESS_ERR_BUSY]);
+	  ret = -EAGAIN;
+	  break;
+	}
+      ret = cypress_wait_write(dev);
+      if (ret < 0)
+	break;
     }
-
-  // send to USB
-  ret = cypress_write(serial, writebuff, cpy_len);
+  trace_brl_usb_write(serial, cpy_len, client->out_buffer[0], ret < 0 ? ret : 0);
+  mutex_unlock(&client->io_mutex);
   if (ret < 0)
     {
-      printk("Write op failed.\n");
+      if (ret != -EAGAIN && ret != -ERESTARTSYS)
+	{
+	  cypress_log("Write op failed (%d)\n", ret);
+	  client->stats.errors++;
+	}
       return ret;
     }
-  return cpy_len;    // on success, return value = cpy_len
+  client->stats.writes++;
+  client->stats.write_bytes += cpy_len;
+  return cpy_len;
+}
+
+/* test_write()
+ *    - This is the file write_iter() handler.  Each iovec is one packet of
+ *  at most USB_MAX_OUT_LEN bytes, so a writev() queues several packets in
+ *  one call.  A longer iovec is cut to one packet and ends the batch, as a
+ *  long write() always did.  Once something is queued, an error (or
+ *  -EAGAIN when the write urbs are full) ends the batch with a short count.
+ */
+ssize_t test_write(struct kiocb *iocb, struct iov_iter *from)
+{
+  struct brl_usb_client *client = iocb->ki_filp->private_data;
+  int nonblock = iocb_nonblock(iocb);
+  ssize_t total = 0;
+  ssize_t ret;
+  size_t room;
+
+  do
+    {
+      room = packet_room(from);
+      ret = write_packet(client, from, min(room, (size_t)USB_MAX_OUT_LEN), nonblock);
+      if (ret < 0)
+	return total ? total : ret;
+      total += ret;
+    }
+  while (room && ret == room && iov_iter_count(from));
+
+  return total;    // on success, return value = bytes queued
 }
   
 int test_release(struct inode *inode, 
 		 struct file *pfile)
 {
-  struct usb_cypress *dev = (struct usb_cypress*) pfile->private_data;
+  struct brl_usb_client *client = pfile->private_data;
+  struct usb_cypress *dev = client->dev;
   int serial = dev->boardSerialNum;
+  int last = atomic_dec_and_test(&dev->open_count);
 
-  printk("test release (%d)\n\n",serial);
-  atomic_set( &dev->fs_operable, 0);                // stop new read/write ops
-  spin_lock(&dev->lock);                            // lock device struct
-  if(atomic_read(&dev->read_busy))
+  cypress_log("test release (%d)%s\n", serial, last ? ", last" : "");
+
+  // only tear down what this file started, unless nobody is left
+  if (last || READ_ONCE(dev->ring_owner) == client)
     {
-      msleep(5);
-      printk("unlink r\n");
-      usb_kill_urb(dev->read_urb);                // terminate an ongoing read
+      cypress_cycle_disable(dev);
+      cypress_stop_stream(dev);
+      cmpxchg(&dev->ring_owner, client, NULL);
     }
 
-  if(atomic_read(&dev->write_busy))
+  if (READ_ONCE(dev->read_owner) == client)
     {
-      msleep(5);
-      printk("unlink w? ");
-      if(atomic_read(&dev->write_busy)) 
+      if(cypress_read_busy(dev))
 	{
-	  usb_kill_urb(dev->write_urb);               // terminate an ongoing write
-	  printk("yes");
+	  msleep(5);
+	  cypress_log("unlink r\n");
+	  usb_kill_urb(dev->read_urb);              // it would land in client->in_buffer
 	}
-      printk("\n");
-      }
-  spin_unlock(&dev->lock);
-  
+      release_read(dev, client);
+    }
+
+  if(last && atomic_read(&dev->write_busy))
+    {
+      msleep(5);
+      cypress_log("unlink w (%d queued)\n", atomic_read(&dev->write_busy));
+      cypress_kill_writes(dev);                     // terminate queued writes
+    }
+
+  kfree(client);
+  cypress_put_board(dev);
   return 0; 
 }
 
 int test_flush(struct file *pfile, fl_owner_t id)
 {
-  struct usb_cypress *dev = (struct usb_cypress*) pfile->private_data;
-  printk("test flush (%d)\n\n",dev->boardSerialNum);
+  struct brl_usb_client *client = pfile->private_data;
+  cypress_log("test flush (%d)\n",client->dev->boardSerialNum);
   return 0; 
 }
 
+/* test_poll()
+ *    - poll()/epoll() handler.
+ *
+ *  POLLIN is reported once a read this file started with ioctl(4) has
+ *  completed, or
+ *  while streaming or cycling once the stream ring is non-empty, i.e.
+ *  read() will return data without sleeping.  POLLOUT is reported while a
+ *  write urb is idle, and always in mailbox mode.  Both are driven by the bulk callbacks waking
+ *  read_wait/write_wait.
+ */
+__poll_t test_poll(struct file *pfile, poll_table *wait)
+{
+  struct brl_usb_client *client = pfile->private_data;
+  struct usb_cypress *dev = client->dev;
+  __poll_t mask = 0;
+
+  poll_wait(pfile, &dev->read_wait, wait);
+  poll_wait(pfile, &dev->write_wait, wait);
+
+  if (!dev->present)
+    return EPOLLERR | EPOLLHUP;
+
+  if (cypress_ring_active(dev))
+    {
+      if (cypress_stream_pending(dev))
+	mask |= EPOLLIN | EPOLLRDNORM;
+    }
+  else if (READ_ONCE(dev->read_owner) == client && cypress_read_completed(dev))
+    mask |= EPOLLIN | EPOLLRDNORM;
+
+  if (client->write_mode == BRL_USB_WRITE_MAILBOX || cypress_write_ready(dev))
+    mask |= EPOLLOUT | EPOLLWRNORM;
+
+  return mask;
+}
+
+/* test_mmap()
+ *    - maps the board's packet ring (struct brl_usb_ring_header followed
+ *  by the packet slots, see brl_usb_ioctl.h) into the caller.  In
+ *  streaming mode the consumer can then read packets without a syscall.
+ *  At BRL_USB_SAMPLE_MAP_OFFSET it maps the latest-sample page instead,
+ *  read-only so that monitors cannot disturb the producer.
+ */
+int test_mmap(struct file *pfile, struct vm_area_struct *vma)
+{
+  struct brl_usb_client *client = pfile->private_data;
+  struct usb_cypress *dev = client->dev;
+
+  if (!dev->present || dev->ring_area == NULL)
+    return -ENODEV;
+
+  if (vma->vm_pgoff == BRL_USB_SAMPLE_MAP_OFFSET >> PAGE_SHIFT)
+    {
+      if (vma->vm_flags & VM_WRITE)
+	return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+      vm_flags_clear(vma, VM_MAYWRITE);
+#else
+      vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+      return remap_vmalloc_range(vma, dev->sample, 0);
+    }
+  if (vma->vm_pgoff != 0)
+    return -EINVAL;
+
+  // fails with -EINVAL if the vma is larger than the ring
+  return remap_vmalloc_range(vma, dev->ring_area, 0);
+}
+
+/* xfer_stamps()
+ *    - copy the completion stamps of the exchange that just finished on
+ *  dev into x, after x->in_len is set.  The caller still holds dev's read
+ *  urb.
+ */
+static void xfer_stamps(struct usb_cypress *dev, struct brl_usb_xfer *x)
+{
+  x->out_ns = dev->exchange_stamp.ns;
+  x->out_frame = dev->exchange_stamp.frame;
+  x->in_ns = x->in_len ? dev->read_stamp.ns : 0;
+  x->in_frame = x->in_len ? dev->read_stamp.frame : 0;
+}
+
+/* ioctl_xfer()
+ *    - BRL_USB_IOC_XFER: write the OUT packet and collect the board's reply
+ *  in one call.  Replaces the write() / ioctl(4) / read() sequence.
+ */
+static long ioctl_xfer(struct brl_usb_client *client, struct brl_usb_xfer __user *uxfer)
+{
+  struct usb_cypress *dev = client->dev;
+  struct brl_usb_xfer xfer;
+  size_t out_len, in_len;
+  ssize_t bytesRead;
+  long ret;
+
+  if (copy_from_user(&xfer, uxfer, sizeof(xfer)))
+    return -EFAULT;
+
+  out_len = min_t(size_t, xfer.out_len, USB_MAX_OUT_LEN);
+  in_len = min_t(size_t, xfer.in_len, USB_MAX_IN_LEN);
+
+  if (mutex_lock_interruptible(&client->io_mutex))
+    return -ERESTARTSYS;
+
+  if (claim_read(dev, client)) {
+    mutex_unlock(&client->io_mutex);
+    return -EBUSY;
+  }
+
+  if (copy_from_user(client->out_buffer, u64_to_user_ptr(xfer.out_buf), out_len)) {
+    ret = -EFAULT;
+    goto exit;
+  }
+
+  ret = cypress_submit_exchange(dev, client->out_buffer, out_len, client->in_buffer, in_len, NULL, NULL, NULL);
+  if (ret < 0)
+    goto exit;
+
+  ret = cypress_wait_read(dev, read_timeout_us);
+  if (ret < 0) {
+    // don't leave the exchange running after we give up on it
+    cypress_cancel_exchange(dev);
+    goto exit;
+  }
+
+  bytesRead = min_t(size_t, dev->read_actual_length, USB_MAX_IN_LEN);
+  if (bytesRead <= 0) {
+    ret = -EIO;
+    goto exit;
+  }
+
+  xfer.in_len = bytesRead;
+  xfer_stamps(dev, &xfer);
+  if (copy_to_user(u64_to_user_ptr(xfer.in_buf), client->in_buffer, bytesRead) ||
+      copy_to_user(uxfer, &xfer, sizeof(xfer))) {
+    ret = -EFAULT;
+    goto exit;
+  }
+  client->stats.writes++;
+  client->stats.write_bytes += out_len;
+  client->stats.reads++;
+  client->stats.read_bytes += bytesRead;
+  ret = 0;
+
+ exit:
+  if (ret < 0 && ret != -ERESTARTSYS)
+    client->stats.errors++;
+  release_read(dev, client);
+  mutex_unlock(&client->io_mutex);
+  return ret;
+}
+
+/* Request and per-board packet buffers for BRL_USB_IOC_MULTI_XFER.  A
+ * multi-board exchange occupies every board it names, so one fixed set
+ * serialized by multi_mutex is enough and the call never allocates. */
+static DEFINE_MUTEX(multi_mutex);
+static struct brl_usb_multi_xfer multi_req;
+static struct {
+  char out[USB_MAX_OUT_LEN];
+  char in[USB_MAX_IN_LEN];
+} multi_buffers[BRL_USB_MULTI_MAX];
+
+/* Bound on a MULTI_XFER when read_timeout_us is 0 (no limit for read()) */
+#define MULTI_XFER_TIMEOUT_US 1000000
+
+/* ioctl_multi_xfer()
+ *    - BRL_USB_IOC_MULTI_XFER: exchange with every listed board at once.
+ *  All OUT and IN urbs are anchored together and submitted back to back;
+ *  we return once the anchor drains, i.e. when the last board has replied.
+ */
+static long ioctl_multi_xfer(struct brl_usb_multi_xfer __user *umx)
+{
+  struct usb_cypress *devs[BRL_USB_MULTI_MAX] = {NULL};
+  struct brl_usb_multi_xfer *mx = &multi_req;
+  struct usb_anchor anchor;
+  unsigned int i;
+  long left, ret = 0;
+
+  if (mutex_lock_interruptible(&multi_mutex))
+    return -ERESTARTSYS;
+
+  if (copy_from_user(mx, umx, sizeof(*mx))) {
+    ret = -EFAULT;
+    goto exit;
+  }
+
+  if (mx->count == 0 || mx->count > BRL_USB_MULTI_MAX) {
+    ret = -EINVAL;
+    goto exit;
+  }
+
+  // Resolve boards and stage all OUT packets before touching the bus.
+  // Other files' boards can be unplugged meanwhile, so hold a reference.
+  for (i = 0; i < mx->count; i++) {
+    devs[i] = cypress_get_board(mx->boards[i].serial);
+    if (devs[i] == NULL) {
+      ret = -ENODEV;
+      goto release;
+    }
+  }
+
+  // hold every board's read urb against the other open files
+  for (i = 0; i < mx->count; i++) {
+    if (claim_read(devs[i], mx)) {
+      ret = -EBUSY;
+      goto release;
+    }
+  }
+
+  for (i = 0; i < mx->count; i++) {
+    struct brl_usb_xfer *x = &mx->boards[i].xfer;
+
+    x->out_len = min_t(__u32, x->out_len, USB_MAX_OUT_LEN);
+    x->in_len = min_t(__u32, x->in_len, USB_MAX_IN_LEN);
+    if (copy_from_user(multi_buffers[i].out, u64_to_user_ptr(x->out_buf), x->out_len)) {
+      ret = -EFAULT;
+      goto release;
+    }
+  }
+
+  init_usb_anchor(&anchor);
+  for (i = 0; i < mx->count; i++) {
+    struct brl_usb_xfer *x = &mx->boards[i].xfer;
+
+    ret = cypress_submit_exchange(devs[i], multi_buffers[i].out, x->out_len,
+				  multi_buffers[i].in, x->in_len, &anchor, NULL, NULL);
+    if (ret < 0) {
+      usb_kill_anchored_urbs(&anchor);
+      goto release;
+    }
+  }
+
+  // usb_wait_anchor_empty_timeout() would sleep uninterruptibly, holding
+  // multi_mutex, for as long as one board stays silent
+  left = wait_event_interruptible_timeout(anchor.wait, usb_anchor_empty(&anchor),
+					  usecs_to_jiffies(read_timeout_us ? read_timeout_us
+							   : MULTI_XFER_TIMEOUT_US));
+  if (left <= 0) {
+    usb_kill_anchored_urbs(&anchor);
+    ret = -ETIME;
+    if (left < 0) {
+      ret = -EINTR;             // not restarted: the packets are already out
+      goto release;
+    }
+  }
+
+  for (i = 0; i < mx->count; i++) {
+    struct brl_usb_xfer *x = &mx->boards[i].xfer;
+    size_t bytesRead = devs[i]->read_actual_length;
+
+    x->in_len = bytesRead;
+    xfer_stamps(devs[i], x);
+    mx->boards[i].status = bytesRead > 0 ? 0 : -EIO;
+    if (bytesRead > 0 && copy_to_user(u64_to_user_ptr(x->in_buf), multi_buffers[i].in, bytesRead))
+      ret = -EFAULT;
+  }
+
+  if (copy_to_user(umx, mx, sizeof(*mx)))
+    ret = -EFAULT;
+
+ release:
+  for (i = 0; i < mx->count; i++)
+    if (devs[i]) {
+      release_read(devs[i], mx);
+      cypress_put_board(devs[i]);
+    }
+ exit:
+  mutex_unlock(&multi_mutex);
+  return ret;
+}
+
+/* ioctl_reset()
+ *    - ioctl(10) and BRL_USB_IOC_RESET: reset the board and wait for its
+ *  ack.  The read urb is held for the whole sequence so no other file's
+ *  read can swallow the ack.
+ */
+static long ioctl_reset(struct brl_usb_client *client, int cmd)
+{
+  struct usb_cypress *dev = client->dev;
+  long ret;
+
+  if (cypress_ring_active(dev))
+    return -EBUSY;
+
+  if (mutex_lock_interruptible(&client->io_mutex))
+    return -ERESTARTSYS;
+  if (claim_read(dev, client)) {
+    mutex_unlock(&client->io_mutex);
+    return -EBUSY;
+  }
+
+  // io_mutex and the claim make this file's buffers ours
+  ret = cypress_reset_board(dev, cmd, client->out_buffer, client->in_buffer, reset_timeout_us);
+
+  release_read(dev, client);
+  mutex_unlock(&client->io_mutex);
+  return ret;
+}
+
 long test_ioctl(struct file* pfile, unsigned int icommand, unsigned long in_readlen){
-  char *buffer;
-  struct usb_cypress *dev = (struct usb_cypress*) pfile->private_data;
+  struct brl_usb_client *client = pfile->private_data;
+  struct usb_cypress *dev = client->dev;
   int serial = dev->boardSerialNum;
   int ret=0;
-  size_t readlen = min((size_t)in_readlen, (size_t)USB_MAX_OUT_LEN);
+  size_t readlen = min((size_t)in_readlen, (size_t)USB_MAX_IN_LEN);
+
+  trace_brl_usb_ioctl(serial, icommand, in_readlen);
 
-  if(!atomic_read(&dev->fs_operable))
+  switch (icommand)
     {
-      return -ENOSPC;
+    case BRL_USB_IOC_STREAM_ON:
+      ret = cypress_start_stream(dev, (unsigned int)in_readlen);
+      if (ret == 0)
+	WRITE_ONCE(dev->ring_owner, client);
+      return ret;
+    case BRL_USB_IOC_STREAM_OFF:
+      cypress_stop_stream(dev);
+      WRITE_ONCE(dev->ring_owner, NULL);
+      return 0;
+    case BRL_USB_IOC_XFER:
+      return ioctl_xfer(client, (struct brl_usb_xfer __user *)in_readlen);
+    case BRL_USB_IOC_MULTI_XFER:
+      return ioctl_multi_xfer((struct brl_usb_multi_xfer __user *)in_readlen);
+    case BRL_USB_IOC_WRITE_MODE:
+      if (in_readlen != BRL_USB_WRITE_QUEUED && in_readlen != BRL_USB_WRITE_MAILBOX)
+	return -EINVAL;
+      client->write_mode = in_readlen;
+      return 0;
+    case BRL_USB_IOC_GET_SAMPLE:
+      {
+	struct brl_usb_sample sample;
+
+	cypress_get_sample(dev, &sample);
+	if (copy_to_user((void __user *)in_readlen, &sample, sizeof(sample)))
+	  return -EFAULT;
+	return 0;
+      }
+    case BRL_USB_IOC_RESET:
+      if (in_readlen != BRL_USB_RESET_ENC && in_readlen != BRL_USB_RESET_DAC &&
+	  in_readlen != BRL_USB_RESET_ENCDAC)
+	return -EINVAL;
+      return ioctl_reset(client, (int)in_readlen);
+    case BRL_USB_IOC_GET_TIMES:
+      {
+	struct brl_usb_times times;
+
+	cypress_get_times(dev, &times);
+	if (copy_to_user((void __user *)in_readlen, &times, sizeof(times)))
+	  return -EFAULT;
+	return 0;
+      }
+    case BRL_USB_IOC_READ_FORMAT:
+      if (in_readlen != BRL_USB_READ_RAW && in_readlen != BRL_USB_READ_RECORD &&
+	  in_readlen != BRL_USB_READ_DECODED)
+	return -EINVAL;
+      client->read_format = in_readlen;
+      return 0;
+    case BRL_USB_IOC_CLIENT_STATS:
+      if (copy_to_user((void __user *)in_readlen, &client->stats, sizeof(client->stats)))
+	return -EFAULT;
+      return 0;
+    case BRL_USB_IOC_CYCLE:
+      if (in_readlen)
+	{
+	  ret = cypress_cycle_enable(dev);
+	  if (ret == 0)
+	    WRITE_ONCE(dev->ring_owner, client);
+	  return ret;
+	}
+      cypress_cycle_disable(dev);
+      WRITE_ONCE(dev->ring_owner, NULL);
+      return 0;
     }
 
-  buffer = (char*)kmalloc(USB_MAX_OUT_LEN, GFP_ATOMIC);
-  memset(buffer, ENCDAC_RESET, USB_MAX_OUT_LEN);
-  
   // Reset board
 
   if (icommand == 10)
     {
-      printk("ioctl(%d) board %d reset\n", icommand, dev->boardSerialNum);
-      msleep(10);
-      if(atomic_read(&dev->write_busy))
-      msleep(10);
-
-      cypress_write(serial, buffer, USB_MAX_OUT_LEN);
-      msleep(10);
-      cypress_request_read(serial, buffer, 1);
-      msleep(10);
-      cypress_write(serial, buffer, USB_MAX_OUT_LEN);
-      msleep(10);
-      kfree(buffer);
+      cypress_log("ioctl(%d) board %d reset\n", icommand, dev->boardSerialNum);
+      ret = ioctl_reset(client, ENCDAC_RESET);
     }
 
 
   // Initiate USB read
   else if (icommand == 4)
     {
-      if (atomic_read(&dev->read_busy))
+      if (cypress_ring_active(dev))
+	{ // the stream urbs or the cycle engine own the IN endpoint
+	  return -EBUSY;
+	}
+      if (cypress_read_busy(dev))
 	{ // usb core still requesting data
-	  printk("readbusy on %d in ioctl 4\n", serial);
+	  cypress_error(dev, CYPRESS_ERR_BUSY, "readbusy on %d in ioctl 4\n", serial);
 	  return -EBUSY;
 	}
-      else if (atomic_read(&dev->fs_read_busy))
+      else if (READ_ONCE(dev->read_owner) == client)
 	{ // read_get_data() not called. 
-	  printk("read_get not called\n");
-	  kfree(dev->rt_buffer); 
+	  cypress_log("read_get not called\n");
+	}
+      else if (claim_read(dev, client))
+	{ // another open file has not collected its reply yet
+	  return -EBUSY;
 	}
-      atomic_set( &dev->fs_read_busy, 1 );
       
-      // Start read
-      ret = cypress_request_read( serial, buffer, readlen );
+      // Start read into this file's buffer, on this file's board: after a
+      // replug the serial may name another struct usb_cypress
+      ret = cypress_submit_read( dev, client->in_buffer, readlen, NULL, NULL );
       if (ret < 0 )
 	{
-	  printk("Error requesting read in ioctl: %d\n",ret);
+	  cypress_log("Error requesting read in ioctl: %d\n",ret);
+	  release_read(dev, client);
+	}
+    }
+
+  return ret;
+}
+
+#ifdef BRL_USB_URING
+
+/* State of an io_uring command between its issue and its cqe; lives in
+ * the command's pdu */
+struct brl_usb_uring_pdu
+{
+  struct brl_usb_client *client;
+  unsigned char *	buf;		/* reply of a read (client->in_buffer), NULL for a write */
+  u64			addr;		/* user buffer of a read */
+  s32			res;		/* cqe result */
+  u32			len;		/* bytes of the user buffer */
+};
+
+/* uring_task_done()
+ *    - task context half of an io_uring completion: hand a read's reply to
+ *  userspace, give the IN urb back and post the cqe.
+ */
+static void uring_task_done(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+  struct brl_usb_uring_pdu *pdu = io_uring_cmd_to_pdu(cmd, struct brl_usb_uring_pdu);
+  struct brl_usb_client *client = pdu->client;
+  s32 res = pdu->res;
+
+  if (pdu->buf)
+    {
+      if (res > 0 && copy_to_user(u64_to_user_ptr(pdu->addr), pdu->buf, res))
+	res = -EFAULT;
+      release_read(client->dev, cmd);
+      if (res >= 0)
+	{
+	  client->stats.reads++;
+	  client->stats.read_bytes += res;
 	}
     }
+  else if (res >= 0)
+    {
+      client->stats.writes++;
+      client->stats.write_bytes += res;
+    }
+  if (res < 0)
+    client->stats.errors++;
+
+  io_uring_cmd_done(cmd, res, 0, issue_flags);
+}
+
+/* uring_urb_done()
+ *    - cypress_done_t of io_uring transfers; runs in the urb completion.
+ */
+static void uring_urb_done(void *ctx, int status, size_t actual_length)
+{
+  struct io_uring_cmd *cmd = ctx;
+  struct brl_usb_uring_pdu *pdu = io_uring_cmd_to_pdu(cmd, struct brl_usb_uring_pdu);
+
+  pdu->res = status ? status : (s32)actual_length;
+  io_uring_cmd_complete_in_task(cmd, uring_task_done);
+}
+
+static int uring_write(struct io_uring_cmd *cmd, struct brl_usb_uring_pdu *pdu)
+{
+  struct usb_cypress *dev = pdu->client->dev;
+  unsigned char buf[USB_MAX_OUT_LEN];
+  size_t len = min_t(size_t, pdu->len, USB_MAX_OUT_LEN);
+  ssize_t ret;
+
+  if (copy_from_user(buf, u64_to_user_ptr(pdu->addr), len))
+    return -EFAULT;
+
+  ret = cypress_queue_write(dev, buf, len, uring_urb_done, cmd);
+  if (ret == -EBUSY)
+    atomic_long_inc(&dev->errors[CYPRESS_ERR_BUSY]);
+  trace_brl_usb_write(dev->boardSerialNum, len, buf[0], ret < 0 ? ret : 0);
+  return ret < 0 ? ret : -EIOCBQUEUED;
+}
+
+static int uring_read(struct io_uring_cmd *cmd, struct brl_usb_uring_pdu *pdu,
+		      unsigned int issue_flags)
+{
+  struct brl_usb_client *client = pdu->client;
+  struct usb_cypress *dev = client->dev;
+  int ret;
+
+  // the command owns the IN urb until uring_task_done(), and with it the
+  // file's in_buffer: every other user of in_buffer holds read_owner too
+  if (claim_read(dev, cmd))
+    return -EBUSY;
 
+  pdu->buf = client->in_buffer;
+  io_uring_cmd_mark_cancelable(cmd, issue_flags);
+  ret = cypress_submit_read(dev, pdu->buf, min_t(size_t, pdu->len, USB_MAX_IN_LEN),
+			    uring_urb_done, cmd);
+  if (ret == 0)
+    return -EIOCBQUEUED;
+
+  release_read(dev, cmd);
   return ret;
 }
 
+/* test_uring_cmd()
+ *    - IORING_OP_URING_CMD handler, see BRL_USB_URING_* in brl_usb_ioctl.h.
+ *  Transfers are only queued here; the urb completion posts the cqe.
+ *  Nothing here waits for the bus, so commands complete their issue
+ *  inline, and SQPOLL can keep every board busy without a system call.
+ */
+int test_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+  struct brl_usb_client *client = cmd->file->private_data;
+  struct usb_cypress *dev = client->dev;
+  struct brl_usb_uring_pdu *pdu = io_uring_cmd_to_pdu(cmd, struct brl_usb_uring_pdu);
+  const struct brl_usb_uring_cmd *ucmd = io_uring_sqe_cmd(cmd->sqe);
+
+  BUILD_BUG_ON(sizeof(*pdu) > sizeof(cmd->pdu));
+
+  // the ring is going away: abort a read still waiting for its reply
+  if (issue_flags & IO_URING_F_CANCEL)
+    {
+      if (READ_ONCE(dev->read_owner) == cmd)
+	usb_unlink_urb(dev->read_urb);
+      return 0;
+    }
+
+  if (READ_ONCE(ucmd->flags))
+    return -EINVAL;
+
+  pdu->client = client;
+  pdu->buf = NULL;
+  pdu->addr = READ_ONCE(ucmd->addr);
+  pdu->len = READ_ONCE(ucmd->len);
+
+  switch (cmd->cmd_op)
+    {
+    case BRL_USB_URING_WRITE:
+      return uring_write(cmd, pdu);
+    case BRL_USB_URING_READ:
+      return uring_read(cmd, pdu, issue_flags);
+    }
+  return -EINVAL;
+}
+
+#endif /* BRL_USB_URING */
+
 
 /* End: File ops  */
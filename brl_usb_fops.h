@@ -8,20 +8,24 @@
  */
 #ifndef BRL_USB_FOPS_H
 #define BRL_USB_FOPS_H
+#include <linux/poll.h>
+#include <linux/version.h>
+
+/* io_uring passthrough needs io_uring/cmd.h, i.e. Linux 6.8 */
+#if defined(CONFIG_IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define BRL_USB_URING 1
+#endif
+
 ssize_t test_read(struct file*, 
 			 char*, 
 			 size_t,
 			 loff_t*);
 
-ssize_t read_get_data(struct file*, 
-			 char*, 
-			 size_t,
-		         loff_t*);
+ssize_t read_get_data(struct kiocb*,
+		      struct iov_iter*);
 
-ssize_t test_write(struct file*, 
-			  const char*,
-			  size_t, 
-			  loff_t* );
+ssize_t test_write(struct kiocb*,
+		   struct iov_iter*);
 
 int test_open(struct inode *inode, 
 		     struct file *file);
@@ -35,4 +39,16 @@ long test_ioctl(struct file*,
 		      unsigned int,
 		      unsigned long);
 
+__poll_t test_poll(struct file *file,
+		   poll_table *wait);
+
+int test_mmap(struct file *file,
+	      struct vm_area_struct *vma);
+
+#ifdef BRL_USB_URING
+struct io_uring_cmd;
+int test_uring_cmd(struct io_uring_cmd *cmd,
+		   unsigned int issue_flags);
+#endif
+
 #endif // BRL_USB_FOPS_H
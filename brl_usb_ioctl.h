@@ -0,0 +1,276 @@
+/**
+ * File: brl_usb_ioctl.h
+ *
+ *  I declare the typed ioctl interface of the brl_usb driver.  This file
+ * is shared by the kernel module and by userspace programs, so it must
+ * only depend on the linux uapi headers.
+ *
+ *  The legacy untyped commands (ioctl 4: request read, ioctl 10: reset
+ * board) are still accepted by the driver.
+ */
+#ifndef BRL_USB_IOCTL_H
+#define BRL_USB_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define BRL_USB_IOC_MAGIC 'b'
+
+/* Start streaming mode.  The ioctl argument is the number of IN urbs to
+ * keep in flight (0 selects the driver default).  While streaming, each
+ * read() returns the next packet from the stream ring. */
+#define BRL_USB_IOC_STREAM_ON   _IO(BRL_USB_IOC_MAGIC, 1)
+
+/* Stop streaming mode and drop any unread packets. */
+#define BRL_USB_IOC_STREAM_OFF  _IO(BRL_USB_IOC_MAGIC, 2)
+
+/* One servo cycle in a single call: send out_len bytes from out_buf, then
+ * read the board's reply into in_buf.  The driver submits the read urb
+ * from the write completion, and the ioctl returns once the reply has
+ * landed.  On return in_len holds the number of bytes received and the
+ * stamps the completion of both urbs, as for BRL_USB_IOC_GET_TIMES
+ * (0 if that urb did not complete). */
+struct brl_usb_xfer
+{
+  __u64 out_buf;        /* user pointer to the OUT packet */
+  __u64 in_buf;         /* user pointer to the IN buffer */
+  __u32 out_len;        /* bytes to send */
+  __u32 in_len;         /* in: size of in_buf, out: bytes received */
+  __u64 out_ns;         /* out: CLOCK_MONOTONIC completion time of the OUT urb */
+  __u64 in_ns;          /* out: CLOCK_MONOTONIC completion time of the IN urb */
+  __u32 out_frame;      /* out: USB frame number of the OUT completion */
+  __u32 in_frame;       /* out: USB frame number of the IN completion */
+};
+#define BRL_USB_IOC_XFER        _IOWR(BRL_USB_IOC_MAGIC, 3, struct brl_usb_xfer)
+
+/* Exchange with several boards at once.  May be issued on any board's
+ * node.  The OUT and IN urbs of every listed board are submitted back to
+ * back and the call returns once all boards have replied, so every board's
+ * data comes from the same bus frame window. */
+#define BRL_USB_MULTI_MAX 8
+
+struct brl_usb_board_xfer
+{
+  __s32 serial;               /* board serial number */
+  __s32 status;               /* out: 0 or negative error code */
+  struct brl_usb_xfer xfer;   /* buffers for this board */
+};
+
+struct brl_usb_multi_xfer
+{
+  __u32 count;                /* number of entries used in boards */
+  __u32 reserved;             /* pads boards to 8 bytes */
+  struct brl_usb_board_xfer boards[BRL_USB_MULTI_MAX];
+};
+#define BRL_USB_IOC_MULTI_XFER  _IOWR(BRL_USB_IOC_MAGIC, 4, struct brl_usb_multi_xfer)
+
+/* Select how write() on this open file behaves.  The ioctl argument is one
+ * of the modes below; other files on the same board keep their own mode.
+ * A new file starts in BRL_USB_WRITE_QUEUED.
+ *
+ * BRL_USB_WRITE_QUEUED: every packet is sent, write() waits for a free urb.
+ * BRL_USB_WRITE_MAILBOX: for setpoints such as DAC_WRITE, where only the
+ * newest command matters.  write() never waits: while a packet is on the
+ * bus the new one replaces whatever is still pending, and the completion
+ * sends the newest pending packet. */
+#define BRL_USB_WRITE_QUEUED    0
+#define BRL_USB_WRITE_MAILBOX   1
+#define BRL_USB_IOC_WRITE_MODE  _IO(BRL_USB_IOC_MAGIC, 5)
+
+/* Enable (argument 1) or disable (argument 0) the in-kernel cycle engine
+ * for this board.  Every cycle_period_us (module parameter) the driver
+ * sends the newest mailbox packet and an ENC_REQ, and appends the board's
+ * reply to the packet ring, where read(), poll() and the mmap()ed ring
+ * pick it up exactly as in streaming mode.  Not allowed while streaming. */
+#define BRL_USB_IOC_CYCLE       _IO(BRL_USB_IOC_MAGIC, 6)
+
+/*
+ * Streaming packet ring, shared with userspace through mmap() of the
+ * device node (offset 0, length BRL_USB_RING_MAP_SIZE).
+ *
+ * The driver is the only producer: it fills slot (head % num_slots) from
+ * the urb completion handler and then advances head.  The consumer reads
+ * slots from tail up to head and advances tail itself, so packets can be
+ * consumed without a system call or a copy.  When the ring is full the
+ * driver drops the incoming packet and bumps overruns; a consumer that only
+ * wants the newest sample may jump straight to head - 1.
+ *
+ * head and tail are free running; always index with % num_slots.  read()
+ * in streaming mode consumes from the same ring, so a board should be
+ * drained either through read() or through the mapping, not both.
+ */
+#define BRL_USB_RING_SLOTS       32
+#define BRL_USB_PACKET_LEN       512
+#define BRL_USB_RING_DATA_OFFSET 4096
+
+struct brl_usb_ring_header
+{
+  __u32 head;           /* next slot the driver fills (driver writes) */
+  __u32 overruns;       /* packets dropped because the ring was full */
+  __u32 num_slots;      /* number of packet slots */
+  __u32 slot_size;      /* sizeof(struct brl_usb_slot) */
+  __u32 data_offset;    /* offset of slot 0 from the start of the mapping */
+  __u32 reserved[11];
+  __u32 tail;           /* next slot the consumer reads (consumer writes) */
+  __u32 reserved2[15];
+};
+
+#define BRL_USB_ENC_CHANNELS     8    /* LS7266R1 counters per board */
+
+#define BRL_USB_SLOT_DECODED     0x1  /* position[] holds this packet's encoders */
+
+struct brl_usb_slot
+{
+  __u32 length;         /* number of valid bytes in data */
+  __u32 seq;            /* driver's count of IN packets received, as in brl_usb_record */
+  __u64 timestamp_ns;   /* CLOCK_MONOTONIC completion time of the urb */
+  __u32 flags;          /* BRL_USB_SLOT_* */
+  __u32 frame;          /* USB frame number at completion, see BRL_USB_IOC_GET_TIMES */
+  __s64 position[BRL_USB_ENC_CHANNELS]; /* unwrapped encoder counts, see BRL_USB_READ_DECODED */
+  __u8  data[BRL_USB_PACKET_LEN];
+};
+
+#define BRL_USB_RING_MAP_SIZE \
+  (BRL_USB_RING_DATA_OFFSET + BRL_USB_RING_SLOTS * sizeof(struct brl_usb_slot))
+
+/*
+ * Latest-sample snapshot.  The driver keeps the newest packet received
+ * from the board, whatever mode consumed it, together with its arrival
+ * time.  Any number of readers can take consistent copies without
+ * disturbing the control loop, either with BRL_USB_IOC_GET_SAMPLE or by
+ * mapping the snapshot read-only: mmap() of length BRL_USB_SAMPLE_MAP_SIZE
+ * at offset BRL_USB_SAMPLE_MAP_OFFSET.
+ *
+ * seq works like a kernel seqcount: it is odd while the driver is updating
+ * the snapshot.  A reader of the mapping copies the fields between two
+ * loads of seq and retries if seq was odd or changed:
+ *
+ *   do {
+ *     seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+ *     copy = *s;
+ *     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *   } while ((seq & 1) || seq != __atomic_load_n(&s->seq, __ATOMIC_RELAXED));
+ */
+#define BRL_USB_SAMPLE_MAP_OFFSET 0x100000
+#define BRL_USB_SAMPLE_MAP_SIZE   4096
+
+struct brl_usb_sample
+{
+  __u32 seq;            /* odd while an update is in progress */
+  __u32 length;         /* number of valid bytes in data, 0 before the first packet */
+  __u64 timestamp_ns;   /* CLOCK_MONOTONIC arrival time of the packet */
+  __u64 count;          /* packets received so far; changes with every new sample */
+  __u32 frame;          /* USB frame number at arrival */
+  __u32 reserved;
+  __u8  data[BRL_USB_PACKET_LEN];
+};
+#define BRL_USB_IOC_GET_SAMPLE  _IOR(BRL_USB_IOC_MAGIC, 7, struct brl_usb_sample)
+
+/* Counters of the calling open file only; every open() starts from zero. */
+struct brl_usb_client_stats
+{
+  __u64 reads;          /* packets returned by read() and XFER */
+  __u64 read_bytes;
+  __u64 writes;         /* packets accepted by write() and XFER */
+  __u64 write_bytes;
+  __u64 errors;         /* reads and writes that failed */
+};
+#define BRL_USB_IOC_CLIENT_STATS _IOR(BRL_USB_IOC_MAGIC, 8, struct brl_usb_client_stats)
+
+/* Select what read() on this open file returns.  The ioctl argument is one
+ * of the formats below; every open() starts in BRL_USB_READ_RAW.
+ *
+ * BRL_USB_READ_RAW: the packet bytes only.
+ * BRL_USB_READ_RECORD: a struct brl_usb_record followed by the packet
+ * bytes, so one read() tells both the data and how fresh it is.  The
+ * payload is truncated if the buffer cannot hold all of it; actual_length
+ * still reports the full size.
+ * BRL_USB_READ_DECODED: a struct brl_usb_encoders.  The driver decodes the
+ * eight 24-bit counts of every ENC_READ/ENC_VEL packet as it arrives and
+ * tracks wrap-around per channel, so positions are continuous signed
+ * 64-bit counts.  read() fails with ENODATA for any other packet type
+ * and drops it; a readv() batch instead stops in front of it. */
+#define BRL_USB_READ_RAW        0
+#define BRL_USB_READ_RECORD     1
+#define BRL_USB_READ_DECODED    2
+#define BRL_USB_IOC_READ_FORMAT _IO(BRL_USB_IOC_MAGIC, 9)
+
+struct brl_usb_record
+{
+  __s32 serial;         /* board serial number */
+  __u32 seq;            /* driver's count of IN packets received on any urb of the board */
+  __u64 timestamp_ns;   /* CLOCK_MONOTONIC completion time of the urb */
+  __u32 actual_length;  /* bytes the board sent */
+  __s32 status;         /* urb completion status, 0 on success */
+  __u32 frame;          /* USB frame number at completion */
+  __u32 reserved;
+};
+
+struct brl_usb_encoders
+{
+  __s32 serial;         /* board serial number */
+  __u32 seq;            /* driver's count of IN packets received, as in brl_usb_record */
+  __u64 timestamp_ns;   /* CLOCK_MONOTONIC completion time of the urb */
+  __u32 frame;          /* USB frame number at completion */
+  __u32 reserved;
+  __s64 position[BRL_USB_ENC_CHANNELS];
+};
+
+/* Completion times of the board's last IN and OUT transfers, and a fresh
+ * (monotonic time, frame number) pair taken back to back.  Every time in
+ * this interface is captured in the urb completion handler, not when
+ * userspace asks, so packets of several boards can be ordered on one
+ * timebase; boards on the same host controller also share the frame
+ * counter.  Frame numbers count 1 ms bus frames and wrap at a width that
+ * depends on the host controller; compare them modulo that width. */
+struct brl_usb_times
+{
+  __u64 now_ns;         /* CLOCK_MONOTONIC time of this call */
+  __u32 now_frame;      /* frame number read together with now_ns */
+  __u32 in_seq;         /* seq of the last IN packet, as in brl_usb_record */
+  __u64 in_ns;          /* completion time of the last IN transfer, 0 if none */
+  __u32 in_frame;
+  __u32 out_length;     /* bytes sent by the last OUT transfer */
+  __u64 out_ns;         /* completion time of the last OUT transfer, 0 if none */
+  __u32 out_frame;
+  __u32 reserved;
+};
+#define BRL_USB_IOC_GET_TIMES   _IOR(BRL_USB_IOC_MAGIC, 10, struct brl_usb_times)
+
+/* Reset the board's encoders, DACs or both; the argument is one of the
+ * values below.  The call returns as soon as the board acknowledges the
+ * reset, or fails with ETIME after the reset_timeout_us module parameter
+ * (0 waits for the ack, until a signal).
+ * The legacy ioctl 10 is BRL_USB_RESET_ENCDAC.  Not allowed while
+ * streaming or in the cycle engine. */
+#define BRL_USB_RESET_ENC       0x01
+#define BRL_USB_RESET_DAC       0x05
+#define BRL_USB_RESET_ENCDAC    0x07
+#define BRL_USB_IOC_RESET       _IO(BRL_USB_IOC_MAGIC, 11)
+
+/*
+ * io_uring passthrough.  An IORING_OP_URING_CMD on a board node, with
+ * cmd_op one of the operations below and a struct brl_usb_uring_cmd in
+ * sqe->cmd, queues the transfer and returns at once; its cqe is posted
+ * from the urb completion.  One io_uring_enter() can thus start the DAC
+ * writes and encoder reads of every board, and with IORING_SETUP_SQPOLL
+ * the servo loop needs no system call at all.
+ *
+ * BRL_USB_URING_WRITE: send len bytes from addr as one OUT packet.  cqe
+ * res is the number of bytes sent, or a negative error code; -EBUSY means
+ * the board's write queue was full.
+ * BRL_USB_URING_READ: read one IN packet into addr, at most len bytes.
+ * cqe res is the number of bytes received, or a negative error code; the
+ * read holds the board's IN urb like ioctl(4) does until its cqe is posted.
+ */
+#define BRL_USB_URING_WRITE     1
+#define BRL_USB_URING_READ      2
+
+struct brl_usb_uring_cmd
+{
+  __u64 addr;           /* user buffer */
+  __u32 len;            /* its size */
+  __u32 flags;          /* must be 0 */
+};
+
+#endif // BRL_USB_IOCTL_H
@@ -0,0 +1,94 @@
+/**
+ * File: brl_usb_trace.h
+ *
+ *  Static tracepoints for the brl_usb packet lifecycle.  Enable them with
+ *  ftrace or perf, e.g.
+ *
+ *    echo 1 > /sys/kernel/tracing/events/brl_usb/enable
+ *
+ *  Every packet event carries the board serial, the transfer length, the
+ *  packet type byte (ENC_READ, DAC_WRITE, ...) and a status code, so a
+ *  cycle's latency can be split between syscall, usb core and callback.
+ *  A disabled tracepoint costs a patched-out branch.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM brl_usb
+
+#if !defined(_BRL_USB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BRL_USB_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(brl_usb_ioctl,
+	TP_PROTO(int serial, unsigned int cmd, unsigned long arg),
+	TP_ARGS(serial, cmd, arg),
+	TP_STRUCT__entry(
+		__field(int, serial)
+		__field(unsigned int, cmd)
+		__field(unsigned long, arg)
+	),
+	TP_fast_assign(
+		__entry->serial = serial;
+		__entry->cmd = cmd;
+		__entry->arg = arg;
+	),
+	TP_printk("board=%d cmd=0x%x arg=0x%lx",
+		  __entry->serial, __entry->cmd, __entry->arg)
+);
+
+DECLARE_EVENT_CLASS(brl_usb_packet,
+	TP_PROTO(int serial, size_t len, u8 type, int status),
+	TP_ARGS(serial, len, type, status),
+	TP_STRUCT__entry(
+		__field(int, serial)
+		__field(size_t, len)
+		__field(u8, type)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->serial = serial;
+		__entry->len = len;
+		__entry->type = type;
+		__entry->status = status;
+	),
+	TP_printk("board=%d len=%zu type=0x%02x status=%d",
+		  __entry->serial, __entry->len, __entry->type, __entry->status)
+);
+
+/* read urb submitted; type is unknown until the reply arrives */
+DEFINE_EVENT(brl_usb_packet, brl_usb_read_submit,
+	TP_PROTO(int serial, size_t len, u8 type, int status),
+	TP_ARGS(serial, len, type, status));
+
+/* write urb submitted, status is the usb_submit_urb() result */
+DEFINE_EVENT(brl_usb_packet, brl_usb_write_submit,
+	TP_PROTO(int serial, size_t len, u8 type, int status),
+	TP_ARGS(serial, len, type, status));
+
+/* read urb completed, status is urb->status */
+DEFINE_EVENT(brl_usb_packet, brl_usb_read_complete,
+	TP_PROTO(int serial, size_t len, u8 type, int status),
+	TP_ARGS(serial, len, type, status));
+
+/* write urb completed, status is urb->status */
+DEFINE_EVENT(brl_usb_packet, brl_usb_write_complete,
+	TP_PROTO(int serial, size_t len, u8 type, int status),
+	TP_ARGS(serial, len, type, status));
+
+/* read() copied a packet out to userspace */
+DEFINE_EVENT(brl_usb_packet, brl_usb_copy_out,
+	TP_PROTO(int serial, size_t len, u8 type, int status),
+	TP_ARGS(serial, len, type, status));
+
+/* write() handed a packet to the driver */
+DEFINE_EVENT(brl_usb_packet, brl_usb_write,
+	TP_PROTO(int serial, size_t len, u8 type, int status),
+	TP_ARGS(serial, len, type, status));
+
+#endif /* _BRL_USB_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE brl_usb_trace
+#include <trace/define_trace.h>
@@ -23,9 +23,21 @@
 
 #include "bulk_cypress.h"
 
+#define CREATE_TRACE_POINTS
+#include "brl_usb_trace.h"
+
 // Variable storing the number of attached boards
 char usb_board_count = 0; 
-struct usb_cypress_node USBBoards[MAX_BOARDS];
+
+// Attached boards indexed by serial number.  Readers use rcu_read_lock();
+// addNode()/removeNode() update the table under boards_mutex.
+struct usb_cypress __rcu *USBBoards[MAX_BOARDS];
+static DECLARE_BITMAP(activeBoards, MAX_BOARDS);
+static DEFINE_MUTEX(boards_mutex);
+
+bool cypress_verbose = 0;
+module_param_named(verbose, cypress_verbose, bool, 0644);
+MODULE_PARM_DESC(verbose, "Log errors from the read, write and ioctl paths (rate limited, default off)");
 
 //Symbol showing number of USB boards
 EXPORT_SYMBOL(usb_board_count);
@@ -38,20 +50,34 @@ EXPORT_SYMBOL(cypress_read);
 //EXPORT_SYMBOL(cypress_read_no_urb);
 EXPORT_SYMBOL(cypress_request_read);
 //EXPORT_SYMBOL(cypress_write);
+EXPORT_SYMBOL(cypress_write_mailbox);
 //EXPORT_SYMBOL(cypress_write_no_urb);
 
+//In-kernel client API: board references, exchanges with a completion
+//callback and sample listeners
+EXPORT_SYMBOL(cypress_get_board);
+EXPORT_SYMBOL(cypress_put_board);
+EXPORT_SYMBOL(cypress_board_exchange);
+EXPORT_SYMBOL(cypress_add_listener);
+EXPORT_SYMBOL(cypress_remove_listener);
+
 /**
  * define file operations and stuff. 
  */ 
 static const struct file_operations cypress_fops = {
   .owner =	THIS_MODULE,
   //  .read =	test_read,
-  .read =	read_get_data,
-  .write =	test_write,
+  .read_iter =	read_get_data,
+  .write_iter =	test_write,
   .open =	test_open,
   .release=	test_release,
   .flush =	test_flush,
   .unlocked_ioctl = test_ioctl,
+  .poll =	test_poll,
+  .mmap =	test_mmap,
+#ifdef BRL_USB_URING
+  .uring_cmd =	test_uring_cmd,
+#endif
   // ioctl has been removed from the linux kernel in favor of unlocked_ioctl
 };
 
@@ -75,21 +101,45 @@ static struct usb_class_driver cypress_class = {
 };
 
 /**
- * addNode - Add data for a USB node to the linked list data structure
+ * addNode - Add a board to the USBBoards table under its cached serial number
  * 
- *  result - success 0 or failure -1
+ *  result - success 0 or failure -EBUSY if the serial is already attached
  */
 int addNode(struct usb_cypress *dev)
 {
-  int serialNum = getSerialNum(dev);
-  USBBoards[serialNum].isActive = TRUE;      //Set the board as active
-  USBBoards[serialNum].data = dev;           //Set pointer with data to point to dev struct
-  usb_board_count++;                         //Update count of number of USB boards attached
+  int serialNum = dev->boardSerialNum;
+
+  mutex_lock(&boards_mutex);
+  if (rcu_access_pointer(USBBoards[serialNum]) != NULL)
+    {
+      mutex_unlock(&boards_mutex);
+      printk(DRIVER_DESC ": USB Board #%d is already attached\n", serialNum);
+      return -EBUSY;
+    }
+  rcu_assign_pointer(USBBoards[serialNum], dev);  //Publish dev struct for this serial
+  set_bit(serialNum, activeBoards);               //Set the board as active
+  usb_board_count++;                              //Update count of number of USB boards attached
+  mutex_unlock(&boards_mutex);
 
   printk(DRIVER_DESC ": USB Board #%d Successfully Attached\n",serialNum);
   return 0;
 }
 
+/**
+ * cypress_find_board - look up an attached board by serial number
+ *
+ * O(1) and lock free.  The caller must hold rcu_read_lock() for as long as
+ * it uses the result.
+ *
+ *  result - the board's device struct, or NULL if no such board is attached.
+ */
+struct usb_cypress *cypress_find_board(int serial)
+{
+  if (serial < 0 || serial >= MAX_BOARDS)
+    return NULL;
+  return rcu_dereference(USBBoards[serial]);
+}
+
 /**
  *	cypress_delete
  */
@@ -100,14 +150,51 @@ inline void cypress_delete (struct usb_cypress *dev)
   usb_free_coherent (dev->udev, dev->bulk_in_size,
 		   dev->bulk_in_buffer,
 		   dev->read_urb->transfer_dma);
-  usb_free_coherent (dev->udev, dev->bulk_out_size,
-		   dev->bulk_out_buffer,
-		   dev->write_urb->transfer_dma);
   usb_free_urb (dev->read_urb);
-  usb_free_urb (dev->write_urb);
+  cypress_free_write_slots(dev);
+  cypress_free_ring(dev);
+  usb_put_dev(dev->udev);
   kfree(dev);
 }
 
+static void cypress_release(struct kref *kref)
+{
+  cypress_delete(container_of(kref, struct usb_cypress, kref));
+}
+
+/**
+ * cypress_get_board - take a reference to an attached board by serial number
+ *
+ * For in-kernel clients, instead of indexing USBBoards[] directly.  The
+ * struct stays valid until the matching cypress_put_board(), even across a
+ * disconnect; calls on an unplugged board fail with -ENODEV.  Safe from
+ * any context.
+ *
+ *  result - the board, or NULL if serial is out of range or not attached.
+ */
+struct usb_cypress *cypress_get_board(int serial)
+{
+  struct usb_cypress *dev;
+
+  rcu_read_lock();
+  dev = cypress_find_board(serial);
+  if (dev != NULL && !kref_get_unless_zero(&dev->kref))
+    dev = NULL;
+  rcu_read_unlock();
+  return dev;
+}
+
+/**
+ * cypress_put_board - drop a reference from cypress_get_board()
+ *
+ * Frees the board if it has been unplugged and this was the last user, so
+ * it must be called from process context.
+ */
+void cypress_put_board(struct usb_cypress *dev)
+{
+  kref_put(&dev->kref, cypress_release);
+}
+
 /**
  *	cypress_disconnect
  *
@@ -128,19 +215,17 @@ void cypress_disconnect(struct usb_interface *interface)
   usb_deregister_dev(interface, &cypress_class);    // Disconnect devfs and give back minor
   dev = usb_get_intfdata(interface);               //  "
   usb_set_intfdata (interface, NULL);               //  "
-// Check these spinlocks
-  spin_lock(&dev->lock);
-  if(atomic_read(&dev->read_busy))
-    {
-      usb_unlink_urb(dev->read_urb);                // terminate an ongoing read
-    }
-  if(atomic_read(&dev->write_busy))
-    {
-      usb_unlink_urb(dev->write_urb);               // terminate an ongoing write
-    }
+  removeNode(dev);                                  // no new lookups by serial
+  cypress_stats_remove_board(dev);
   dev->present = 0;                                 // prevent device read, write and ioctl
-  spin_unlock(&dev->lock);
-  cypress_delete (dev);
+  usb_poison_urb(dev->read_urb);                    // terminate an ongoing read, fail any racing submit
+  spin_lock_irq(&dev->mailbox_lock);                // let a mailbox resubmit that raced
+  spin_unlock_irq(&dev->mailbox_lock);              //  with present = 0 finish first
+  wake_up_interruptible(&dev->write_wait);          // release writers waiting for a slot
+  cypress_kill_writes(dev);                         // terminate queued writes
+  cypress_cycle_disable(dev);                       // leave the cycle engine
+  cypress_stop_stream(dev);                         // kill and free any stream urbs
+  cypress_put_board(dev);                           // freed now, or by the last close()/put
   printk("brl_usb disconnect -> done!\n");
 }
 
@@ -151,14 +236,10 @@ void cypress_disconnect(struct usb_interface *interface)
 void cypress_listActiveBoards(int *list)
 {
   int i, count = 0;
-  for (i = 0; i < MAX_BOARDS; i++)
+  for_each_set_bit(i, activeBoards, MAX_BOARDS)
     {
-      if (USBBoards[i].isActive)        // Check for an active board if so add it to list
-	{
-	  list[count] = i;
-	  count++;
-	}
-      if (count == usb_board_count)    // Stop if we have found all the boards
+      list[count] = i;
+      if (++count == usb_board_count)  // Stop if we have found all the boards
 	return;
     }
 }
@@ -202,8 +283,16 @@ int cypress_probe(struct usb_interface *interface, const struct usb_device_id *i
       return -ENOMEM;
     }
   memset(dev, 0x00, sizeof (*dev));
-
-  dev->udev = udev;
+  kref_init(&dev->kref);
+  INIT_LIST_HEAD(&dev->listeners);
+  mutex_init(&dev->stream_mutex);
+  spin_lock_init(&dev->ring_lock);
+  spin_lock_init(&dev->mailbox_lock);
+  spin_lock_init(&dev->sample_lock);
+  seqlock_init(&dev->in_stamp_lock);
+  seqlock_init(&dev->out_stamp_lock);
+
+  dev->udev = usb_get_dev(udev);      /* cypress_delete() may run after disconnect */
   dev->interface = interface;
 
   /* Set up the endpoint information */
@@ -248,38 +337,18 @@ int cypress_probe(struct usb_interface *interface, const struct usb_device_id *i
 	  ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK) )
 	{
 	  /* we found a bulk out endpoint */
-	  /* a probe() may sleep and has no restrictions on memory allocations */
-	  dev->write_urb = usb_alloc_urb(0, GFP_ATOMIC);
-	  if( dev->write_urb == NULL )
-	    {
-	      printk("No free urbs available");
-	      goto error;
-	    }
 	  dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
+	  dev->bulk_out_size = endpoint->wMaxPacketSize;
 
-	  /* on some platforms using this kind of buffer alloc
-	   * call eliminates a dma "bounce buffer".
-	   *
-	   * NOTE: you'd normally want i/o buffers that hold
-	   * more than one packet, so that i/o delays between
-	   * packets don't hurt throughput.
+	  /* a probe() may sleep and has no restrictions on memory allocations;
+	   * every urb of the write queue gets its own buffer so back-to-back
+	   * writes pipeline instead of waiting on one another.
 	   */
-	  buffer_size = endpoint->wMaxPacketSize;
-	  dev->bulk_out_size = buffer_size;
-	  dev->write_urb->transfer_flags = (URB_NO_TRANSFER_DMA_MAP);
-	  dev->bulk_out_buffer = usb_alloc_coherent (udev,
-						   buffer_size, GFP_ATOMIC,
-						   &dev->write_urb->transfer_dma);
-	  if( dev->bulk_out_buffer == NULL )
+	  if( cypress_alloc_write_slots(dev) )
 	    {
-	      printk("Couldn't allocate bulk_out_buffer");
+	      printk("Couldn't allocate write urbs");
 	      goto error;
 	    }
-	  usb_fill_bulk_urb(dev->write_urb, udev,
-			    usb_sndbulkpipe(udev,
-					    endpoint->bEndpointAddress),
-			    dev->bulk_out_buffer, buffer_size,
-			    (usb_complete_t)cypress_write_bulk_callback, dev);
 	}
     }
   if (!(dev->bulk_in_endpointAddr && dev->bulk_out_endpointAddr))
@@ -288,9 +357,31 @@ int cypress_probe(struct usb_interface *interface, const struct usb_device_id *i
       goto error;
     }
 
+  if (cypress_alloc_ring(dev))
+    {
+      printk("Couldn't allocate packet ring");
+      goto error;
+    }
+
+  /* read the serial number once; it indexes USBBoards[] from now on */
+  dev->boardSerialNum = getSerialNum(dev);
+  if (dev->boardSerialNum < 0 || dev->boardSerialNum >= MAX_BOARDS)
+    {
+      printk("Invalid board serial number %d", dev->boardSerialNum);
+      retval = -ENODEV;
+      goto error;
+    }
+
   dev->present = 1;                   /* allow device read, write and ioctl */
   usb_set_intfdata (interface, dev);  /* we can register the device now, as it is ready */
-  spin_lock_init(&(dev->lock));       /* initialize spinlock to unlocked (new kerenel method) */
+  init_waitqueue_head(&dev->read_wait);
+  init_waitqueue_head(&dev->write_wait);
+
+  retval = addNode(dev);
+  if (retval) {
+    usb_set_intfdata(interface, NULL);
+    goto error;
+  }
 
   /* HK: Begin- connect filesystem hooks */
   /* we can register the device now, as it is ready */
@@ -304,14 +395,15 @@ int cypress_probe(struct usb_interface *interface, const struct usb_device_id *i
   dev_info(&interface->dev,
 	   "BRL USB device now attached to minor: %d\n",
 	   interface->minor);                            /* let the user know the device minor */
-  dev->read_task = NULL;                                 /* Initialize fs read_task. */
-  
-  addNode(dev);
+
+  cypress_stats_add_board(dev);
   return 0;
 
  error: // please please please remove goto statements!    HK:Why?
   printk("cypress_probe: error occured!\n");
-  cypress_delete (dev);
+  dev->present = 0;                   /* a cypress_get_board() may have found it already */
+  removeNode(dev);
+  cypress_put_board(dev);
   return retval;
 }
 
@@ -361,55 +453,32 @@ int getSerialNum(struct usb_cypress *dev)
 
 
 /**
- * removeNode - Remove data for a USB node from the linked list data structure
+ * removeNode - Remove a board from the USBBoards table
+ *
+ * Waits for an RCU grace period, so once this returns no lookup can still
+ * be using dev.  Does nothing if dev is not in the table.
  * 
  *  result - success 0 or failure -1
  */
 int removeNode(struct usb_cypress *dev)
 {
-  int i, serialNum = 0;
+  int serialNum = dev->boardSerialNum;
 
-  serialNum = getSerialNum(dev);
-
-  //A device has been disconnected
-  if( serialNum < 0 )
+  mutex_lock(&boards_mutex);
+  if (serialNum < 0 || serialNum >= MAX_BOARDS ||
+      rcu_access_pointer(USBBoards[serialNum]) != dev)
     {
-      for( i = 0; i < MAX_BOARDS; i++ )
-	{
-	  //Look for an active node that has dev structure incorrect
-	  if( (USBBoards[i].isActive == TRUE) && (getSerialNum(USBBoards[i].data) < 0) )
-	    {
-	      USBBoards[i].isActive = FALSE;
-	      USBBoards[i].data = NULL;
-	
-	      usb_board_count--;
-
-	      printk(DRIVER_DESC ": USB board #%d removed from system\n",i);
-	      return 0;
-	    }
-	}
+      mutex_unlock(&boards_mutex);
       return -1;
-    
     }
-  //The driver is being powered off
-  else
-    {
-      for (i = 0; i < MAX_BOARDS; i++)
-	{
-	  //Look for the board and remove it's data structure
-	  if ((USBBoards[i].isActive == TRUE) && (i == serialNum))
-	    {
-	      USBBoards[i].isActive = FALSE;
-	      USBBoards[i].data = NULL;
-	
-	      usb_board_count--;
+  RCU_INIT_POINTER(USBBoards[serialNum], NULL);
+  clear_bit(serialNum, activeBoards);
+  usb_board_count--;
+  mutex_unlock(&boards_mutex);
 
-	      printk(DRIVER_DESC ": USB board #%d detached from driver\n",i);
-	      return 0;
-	    }
-	}
-      return -1;
-    }
+  synchronize_rcu();
+  printk(DRIVER_DESC ": USB board #%d detached from driver\n",serialNum);
+  return 0;
 }
 
 
@@ -424,14 +493,16 @@ void traverse_list(void)
 
   printk("Starting List Traversal\n");
 
-  for (i = 0; i < MAX_BOARDS; i++)
+  rcu_read_lock();
+  for_each_set_bit(i, activeBoards, MAX_BOARDS)
     {
-      dev = USBBoards[i].data;
+      dev = rcu_dereference(USBBoards[i]);
 
-      if (USBBoards[i].isActive == TRUE)
-	printk("USB Serial = %d active. Read Lock = %d, Write Lock = %d\n", i, 
-	       atomic_read(&dev->read_busy), atomic_read(&dev->write_busy));
+      if (dev != NULL)
+	printk("USB Serial = %d active. Read State = %d, Writes Queued = %d\n", i, 
+	       atomic_read(&dev->read_state), atomic_read(&dev->write_busy));
     }
+  rcu_read_unlock();
   printk("List Traversal Complete\n");
 }
 
@@ -442,73 +513,87 @@ struct usb_driver cypress_driver = {
   .id_table =	cypress_table,
   .probe =	cypress_probe,
   .disconnect =	cypress_disconnect,  
+  .dev_groups =	cypress_dev_groups,   /* sysfs error counters, see cypress_stats.c */
 };
 
 /**
- * cypress_reset_encdac() - 
- *    reset board encoders and DACs
+ * cypress_reset_board
+ *
+ * Reset a board's encoders and/or DACs.  cmd is ENCDAC_RESET, ENC_RESET or
+ * DAC_RESET; it is sent as a write-then-read exchange, so the board's reply
+ * is read as soon as the OUT packet is on the wire and we return as soon as
+ * the matching ack arrives.  Packets the board had queued before the reset
+ * are read and skipped.  After an encoder reset, wrap tracking restarts.
+ *
+ * The caller must own dev->read_urb (see claim_read()).  May sleep.
+ *
+ * out, in    - staging buffers of USB_MAX_OUT_LEN and USB_MAX_IN_LEN bytes.
+ * timeout_us - give up if the ack has not arrived after this long, or 0 to
+ *              wait for it, like read_timeout_us.
+ *
+ *  result - 0 once acked, -ETIME on timeout, other negative error codes on failure.
  */
-/*
-int cypress_reset_encdac(int serial){
-  int cnt = 0,   ret;
-
-  char buffer_out[USB_MAX_OUT_LEN] = {0},     buffer_in[USB_MAX_IN_LEN] = {0};
-  struct usb_cypress *dev = USBBoards[serial].data;
+int cypress_reset_board(struct usb_cypress *dev, int cmd, unsigned char *out, unsigned char *in,
+			unsigned int timeout_us)
+{
+  ktime_t deadline;
+  s64 left = 0;
+  int ack;
+  int ret;
 
-  buffer_out[0] = ENCDAC_RESET;                        //Command board to reset ENCS and DACS
-  while( cnt <= USB_MAX_LOOPS )
+  switch (cmd)
     {
-      printk("Resetting write...\n");
-      cnt++;
-      msleep(5);
-
-      if ( cypress_write(serial, buffer_out, 1) != 1 ) // write reset packet to board
-	{
-	  printk("Write failed in cypress_reset_encdac (%d).\n", cnt);  // write failed
-	  continue;
-	}
-      msleep(500);
-      break;
+    case ENCDAC_RESET: ack = ENCDAC_RESET_ACK; break;
+    case ENC_RESET:    ack = ENC_RESET_ACK;    break;
+    case DAC_RESET:    ack = DAC_RESET_ACK;    break;
+    default:
+      return -EINVAL;
     }
 
-  cnt = 0;
-  while( cnt <= USB_MAX_LOOPS )
-    {
-      printk("Resetting write...\n");
-      cnt++;
+  // the whole packet carries the opcode, as the board has always been sent
+  memset(out, cmd, USB_MAX_OUT_LEN);
 
-      if ( cypress_read(serial, buffer_in, 1) <= 0 )
+  deadline = ktime_add_us(ktime_get(), timeout_us);
+  ret = cypress_submit_exchange(dev, out, USB_MAX_OUT_LEN, in, USB_MAX_IN_LEN, NULL, NULL, NULL);
+  while (ret == 0)
+    {
+      if (timeout_us)
 	{
-	  printk("Read failed in cypress_reset_encdac (%d)\n", cnt);
-	  continue;
+	  left = ktime_us_delta(deadline, ktime_get());
+	  if (left <= 0)
+	    {
+	      ret = -ETIME;
+	      break;
+	    }
 	}
-      msleep(500);
-
-      if (buffer_in[0] == ENCDAC_RESET_ACK)       // Rec'd ACK packet
-	return 0;
-      else {                                      //Found some other type of packet
-	printk("Failed ACK in cypress_reset_encdac rec'd %X (%d)\n", buffer_in[0], cnt);
-	continue;
-      }
-    }
-
-  printk("%d timeouts in reading reset [ACK] on (board %d)\n", cnt, serial);
-  return USB_INIT_ERROR;
-}*/
-
-void usb_cypress_debug_data (const char *function, int size, const unsigned char *data)
-{
-  int i;
+      ret = cypress_wait_read(dev, left);
+      if (ret < 0)
+	break;
+      if (dev->read_status || dev->read_actual_length == 0)
+	{
+	  ret = dev->read_status ? dev->read_status : -EIO;
+	  break;
+	}
+      if (in[0] == ack)
+	break;
 
-  if( !debug )
-    return;
+      /* an older packet; the ack is behind it */
+      ret = cypress_submit_read(dev, in, USB_MAX_IN_LEN, NULL, NULL);
+    }
 
-  printk("debug:%d : %s - length = %d, data = ", debug, function, size);
-  for( i = 0; i < size; ++i )
+  if (ret == 0)
     {
-      printk("%.2x ", data[i]);
+      if (cmd != DAC_RESET)
+	cypress_reset_encoders(dev);
     }
-  printk("\n");
+  else
+    {
+      cypress_cancel_exchange(dev);     /* in must not be written after we return */
+      printk(DRIVER_DESC ": No ack to reset 0x%02x, error %d (board %d)\n",
+	     cmd, ret, dev->boardSerialNum);
+    }
+
+  return ret;
 }
 
 /**
@@ -516,17 +601,15 @@ void usb_cypress_debug_data (const char *function, int size, const unsigned char
  */
 int __init usb_cypress_init(void)
 {
-  int result, i;
+  int result;
 
-  for (i = 0; i < MAX_BOARDS; i++)
-    {
-      USBBoards[i].isActive = FALSE;
-    }
+  cypress_stats_init();
 
   /* register this driver with the USB subsystem */
   result = usb_register(&cypress_driver);
   if (result) {
     printk("usb_register failed. Error number %d", result);
+    cypress_stats_exit();
     return result;
   }
 
@@ -548,6 +631,8 @@ void __exit usb_cypress_exit(void)
 {
   /* deregister this driver with the USB subsystem */
   usb_deregister(&cypress_driver);
+  cypress_cycle_exit();
+  cypress_stats_exit();
 }
 
 
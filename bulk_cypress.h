@@ -11,8 +11,21 @@
 #include <linux/module.h>
 #include <linux/smp.h>
 #include <linux/usb.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/bitops.h>
+#include <linux/seqlock.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/version.h>
 #include "brl_usb_fops.h"
+#include "brl_usb_ioctl.h"
 #include <asm/io.h>
+
 #define PARPORT  0x378
 
 #define debug 0
@@ -71,51 +84,271 @@ static int debug = 0;
 #undef dbg
 #define dbg(format, arg...) do { if (debug) printk(KERN_DEBUG __FILE__ ": " format "\n" , ## arg); } while (0)
 
+/* Messages from the read/write/ioctl paths.  A 1 kHz control loop hitting
+ * an error would flood the console and stall on its locks, so these are
+ * off unless the verbose module parameter is set, and rate limited even
+ * then.  Errors are always counted, see cypress_error(). */
+extern bool cypress_verbose;
+#define cypress_log(format, arg...) \
+  do { if (unlikely(READ_ONCE(cypress_verbose))) printk_ratelimited(KERN_INFO DRIVER_DESC ": " format , ## arg); } while (0)
+
+/* Count an error of class (enum cypress_err) on dev, then cypress_log() it */
+#define cypress_error(dev, class, format, arg...) \
+  do { atomic_long_inc(&(dev)->errors[class]); cypress_log(format , ## arg); } while (0)
+
 #define MAX_SERIAL_LENGTH 10  // Maximum length of a serial number
 #define MAX_BOARDS 99         // Maximum number of connected boards
 
-/* Structure to hold all of our device specific stuff */
+#define CYPRESS_STREAM_URBS  8   // Maximum IN urbs kept in flight while streaming
+#define CYPRESS_STREAM_DEFAULT_URBS 2
+
+#define CYPRESS_WRITE_URBS  4    // OUT urbs that may be in flight at once
+
+#define CYPRESS_HIST_BUCKETS 32  // log2 ns buckets, the last one collects >= ~2 s
+
+/* Error classes counted per board; read them in sysfs under errors/ */
+enum cypress_err
+{
+  CYPRESS_ERR_BUSY,		/* refused: read urb or write queue busy */
+  CYPRESS_ERR_UNPLUGGED,	/* request on a disconnected board */
+  CYPRESS_ERR_SHORT,		/* OUT urb sent less than queued, or empty IN packet */
+  CYPRESS_ERR_URB,		/* urb failed to submit or completed with an error */
+  CYPRESS_ERR_NR,
+};
+
+/* Lock-free log2 histogram of urb round-trip times */
+struct cypress_hist
+{
+  atomic64_t		bucket[CYPRESS_HIST_BUCKETS];
+  atomic64_t		count;
+  atomic64_t		max_ns;
+};
+
+/* Per-board encoder wrap tracking, see cypress_decode_encoders() */
+struct cypress_encoders
+{
+  s64			position[BRL_USB_ENC_CHANNELS];	/* unwrapped counts */
+  u32			last[BRL_USB_ENC_CHANNELS];	/* last raw 24-bit counts */
+  int			valid;			/* false until the first packet after a reset */
+};
+
+/*
+ * States of read_urb.  Every transition is a single cmpxchg by the one
+ * party that owns the current state, so no lock is needed around it:
+ *
+ *   IDLE/COMPLETED -> SUBMITTED   whoever wins cypress_read_claim()
+ *   SUBMITTED -> COMPLETED        the completion handler, results in place
+ *   SUBMITTED -> IDLE             the submitter if usb_submit_urb() failed,
+ *                                 or the handler for a reply sent to the ring
+ *   COMPLETED -> IDLE             the consumer, cypress_read_consume()
+ *
+ * A new request may claim a COMPLETED urb, superseding an unread result.
+ */
+enum cypress_urb_state
+{
+  CYPRESS_URB_IDLE = 0,
+  CYPRESS_URB_SUBMITTED,
+  CYPRESS_URB_COMPLETED,
+};
+
+/* When a transfer completed, taken in its completion handler */
+struct cypress_stamp
+{
+  u64			ns;			/* ktime_get_ns() */
+  u32			frame;			/* usb_get_current_frame_number() */
+  u32			seq;			/* rx_seq of an IN packet */
+};
+
+struct usb_cypress;
+
+/* Completion hook of a read or write, called from the urb completion
+ * handler (interrupt context) with the urb status and bytes transferred */
+typedef void (*cypress_done_t)(void *ctx, int status, size_t actual_length);
+
+/* A sample listener, see cypress_add_listener(); embed it in the caller's state */
+struct cypress_listener
+{
+  void (*sample)(struct cypress_listener *l, const u8 *data, size_t len,
+		 const struct cypress_stamp *stamp); /* every IN packet, interrupt context */
+  struct list_head	node;			/* on dev->listeners */
+};
+
+/* One entry of the per-device write queue; it is the context of its urb */
+struct cypress_write_slot
+{
+  struct urb *		urb;			/* preallocated urb with a coherent buffer */
+  struct usb_cypress *	dev;			/* the device owning this slot */
+  int			index;			/* bit of this slot in dev->write_free */
+  int			chain_read;		/* true iff the callback must submit read_urb */
+  int			exchange;		/* true iff this is the OUT half of an exchange */
+  int			mailbox;		/* true iff this urb carries the mailbox */
+  u64			submit_ns;		/* ktime of the last submission */
+  cypress_done_t	done;			/* called when this write completes, or NULL */
+  void *		done_ctx;		/* its argument */
+};
+
+/* Structure to hold all of our device specific stuff.
+ *
+ * The fields are grouped by who writes them, and each group starts on its
+ * own cacheline: the read completion on one CPU and a writer or the write
+ * completion on another must not bounce the same lines.  Keep new fields
+ * in the group of the path that writes them.
+ */
 struct usb_cypress
 {
+  /* control: set up at probe, read-mostly afterwards */
   struct usb_device *	udev;			/* save off the usb device pointer */
   struct usb_interface * interface;		/* the interface for this device */
   unsigned char		num_ports;		/* the number of ports this device has */
   char			num_interrupt_in;	/* number of interrupt in endpoints we have */
   char			num_bulk_in;		/* number of bulk in endpoints we have */
   char			num_bulk_out;		/* number of bulk out endpoints we have */
-
-  struct urb *		read_urb;		/* the urb used to read data */
+  int                   boardSerialNum;                 /* Board serial number, read once at probe */
+  int			present;		/* if the device is not disconnected */
   __u8			bulk_in_endpointAddr;	/* the address of the bulk in endpoint */
-  unsigned char *       bulk_in_buffer;		/* the buffer to receive data */
+  __u8			bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
   size_t		bulk_in_size;		/* the size of the receive buffer */
-  atomic_t		read_busy;		/* true iff read urb is busy */
+  size_t		bulk_out_size;		/* the size of each send buffer */
+  unsigned char *       bulk_in_buffer;		/* the buffer to receive data */
+  atomic_t		streaming;		/* true iff the stream urbs are running */
+  atomic_t		cycling;		/* true iff the cycle engine runs this board */
+  struct dentry *	debugfs_dir;		/* this board's debugfs directory */
+
+  /* read side: read_urb and its completion handler */
+  struct urb *		read_urb ____cacheline_aligned_in_smp; /* the urb used to read data */
+  atomic_t		read_state;		/* enum cypress_urb_state of read_urb */
+  void *		read_owner;		/* open file holding read_urb from ioctl(4)/XFER until it reads, or dev during a cypress_board_exchange() */
   size_t                read_actual_length;     /* the number of bytes transfered in the read operation */
   unsigned char *       rt_buffer;              /* pointer to buffer in RT space to receive inbound data */
+  cypress_done_t	read_done;		/* called when the pending read_urb completes, or NULL */
+  void *		read_done_ctx;		/* its argument */
+  cypress_done_t	board_done;		/* hook of the cypress_board_exchange() holding read_owner */
+  void *		board_done_ctx;		/* its argument */
+  int			read_to_ring;		/* true iff the pending read_urb delivers into the ring */
+  int			read_status;		/* completion status of the last read_urb */
+  u64			read_submit_ns;		/* ktime of the last read_urb submission */
+  struct cypress_stamp	read_stamp;		/* last read_urb completion; seq only on success */
+  struct cypress_stamp	exchange_stamp;		/* OUT completion of the exchange holding read_urb */
+  atomic_t		rx_seq;			/* counts IN packets received on any urb */
+  int			read_decoded;		/* true iff read_position holds the last read_urb packet */
+  s64			read_position[BRL_USB_ENC_CHANNELS]; /* its decoded encoders */
+  wait_queue_head_t     read_wait;              /* woken by the read callback when read_urb completes */
+  seqlock_t		in_stamp_lock;		/* guards in_stamp */
+  struct cypress_stamp	in_stamp;		/* last IN packet received on any urb */
+  struct cypress_hist	read_hist;		/* read_urb round-trip times */
 
-  struct urb *		write_urb;		/* the urb used to send data */
-  __u8			bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
-  unsigned char *	bulk_out_buffer;	/* the buffer to send data */
-  size_t		bulk_out_size;		/* the size of the send buffer */
-  atomic_t		write_busy;		/* true iff write urb is busy */
+  /* write side: the write queue, the mailbox and the write completion */
+  struct cypress_write_slot write_slots[CYPRESS_WRITE_URBS] ____cacheline_aligned_in_smp; /* the write queue */
+  unsigned long		write_free;		/* bitmap of idle write_slots */
+  atomic_t		write_busy;		/* number of write urbs in flight */
+  struct cypress_write_slot * exchange_slot;	/* write half of the last exchange */
   size_t                write_actual_length;    /* the number of bytes transfered in the write operation */
+  wait_queue_head_t     write_wait;             /* woken by the write callback when a slot frees up */
+  seqlock_t		out_stamp_lock;		/* guards out_stamp and write_actual_length for readers */
+  struct cypress_stamp	out_stamp;		/* last OUT urb completion */
+  struct cypress_hist	write_hist;		/* write urb round-trip times */
+  spinlock_t		mailbox_lock;		/* guards the mailbox_* fields, taken from the callback */
+  size_t		mailbox_len;		/* valid bytes in mailbox, 0 if never written */
+  int			mailbox_pending;	/* true iff mailbox has not been sent yet */
+  struct cypress_write_slot * mailbox_slot;	/* the urb carrying the mailbox, or NULL */
+  unsigned long		mailbox_coalesced;	/* packets replaced before they were sent */
+  unsigned char		mailbox[USB_MAX_OUT_LEN]; /* newest mailbox packet */
 
-  int			present;		/* if the device is not disconnected */
-  spinlock_t            lock;                   /* locks this structure */
-  struct task_struct *  read_task;              /* task pointer. Used for wake_up_process in callback */
-  atomic_t		fs_read_busy;		/* true iff a read file operation is in prog. */
-  atomic_t		fs_operable;		/* true iff the filesystem node is "open". */
-  int                   boardSerialNum;                 /* Board serial number */
+  /* packet ring and sample: filled by the IN completions, drained by readers */
+  spinlock_t		ring_lock ____cacheline_aligned_in_smp; /* serializes the driver's ring producer and consumers */
+  unsigned int		stream_head;		/* authoritative producer index, under ring_lock */
+  void *		ring_area;		/* vmalloc_user() area mapped by mmap() */
+  struct brl_usb_ring_header * ring;		/* header page of ring_area */
+  struct brl_usb_slot *	ring_slots;		/* packet slots of ring_area */
+  spinlock_t		sample_lock;		/* serializes snapshot writers and enc; readers use sample->seq */
+  struct list_head	listeners;		/* struct cypress_listener, RCU list */
+  struct brl_usb_sample * sample;		/* latest-sample snapshot, mmap()able read-only */
+  struct cypress_encoders enc;			/* encoder wrap tracking, under sample_lock */
+  unsigned long		cycle_overruns;		/* ticks skipped because the last reply was late */
+  struct usb_anchor	stream_anchor;		/* the in-flight stream urbs */
+  struct urb *		stream_urbs[CYPRESS_STREAM_URBS]; /* urbs resubmitted from their callback */
+  int			stream_num_urbs;	/* number of entries used in stream_urbs */
+  atomic_t		stream_live;		/* stream urbs submitted and not yet retired */
+
+  /* references: written on open, close, get/put and stream start/stop only */
+  atomic_t		open_count ____cacheline_aligned_in_smp; /* number of open files on this board */
+  void *		ring_owner;		/* open file that started streaming or the cycle engine */
+  struct mutex		stream_mutex;		/* serializes stream start/stop */
+  struct kref		kref;			/* held while attached, by open files and in-kernel clients */
+
+  /* errors: written from any path, but only when something goes wrong */
+  atomic_long_t		errors[CYPRESS_ERR_NR] ____cacheline_aligned_in_smp; /* by enum cypress_err */
 };
 
-//Data Structure
-struct usb_cypress_node
+/* Per-open-file state.  Every open() of a board node gets its own, so a
+ * control process and a diagnostics process can share one board; the
+ * device arbitrates read_urb between them through read_owner. */
+struct brl_usb_client
 {
-  char isActive;
-  struct usb_cypress *data;
+  struct usb_cypress *	dev;			/* the board this file was opened on */
+  struct mutex		io_mutex;		/* serializes users of the buffers below */
+  unsigned char		out_buffer[USB_MAX_OUT_LEN]; /* staging for outgoing packets */
+  struct brl_usb_record	in_record;		/* header of a record-format read; in_buffer */
+  unsigned char		in_buffer[USB_MAX_IN_LEN];   /*  must follow it, see read_get_data() */
+  struct brl_usb_client_stats stats;		/* returned by BRL_USB_IOC_CLIENT_STATS */
+  int			read_format;		/* BRL_USB_READ_RAW or BRL_USB_READ_RECORD */
+  int			write_mode;		/* BRL_USB_WRITE_QUEUED or BRL_USB_WRITE_MAILBOX */
 };
 
+/* true iff read_urb and the packet ring belong to streaming or the cycle engine */
+static inline int cypress_ring_active(struct usb_cypress *dev)
+{
+  return atomic_read(&dev->streaming) || atomic_read(&dev->cycling);
+}
+
+/* true iff read_urb is on the bus */
+static inline int cypress_read_busy(struct usb_cypress *dev)
+{
+  return atomic_read_acquire(&dev->read_state) == CYPRESS_URB_SUBMITTED;
+}
+
+/* true iff read_urb has completed and its reply is not consumed yet */
+static inline int cypress_read_completed(struct usb_cypress *dev)
+{
+  return atomic_read_acquire(&dev->read_state) == CYPRESS_URB_COMPLETED;
+}
+
+/**
+ * cypress_read_claim - take read_urb for a new submission.
+ *
+ *  result - the state it was taken from, to hand back to
+ *           cypress_read_unclaim() if the submission is abandoned, or
+ *           -EBUSY if the urb is in flight.
+ */
+static inline int cypress_read_claim(struct usb_cypress *dev)
+{
+  int old = atomic_read(&dev->read_state);
+
+  do
+    {
+      if (old == CYPRESS_URB_SUBMITTED)
+	return -EBUSY;
+    }
+  while (!atomic_try_cmpxchg(&dev->read_state, &old, CYPRESS_URB_SUBMITTED));
+  return old;
+}
+
+/* give read_urb back without submitting it */
+static inline void cypress_read_unclaim(struct usb_cypress *dev, int old)
+{
+  atomic_cmpxchg_release(&dev->read_state, CYPRESS_URB_SUBMITTED, old);
+}
+
+/* take the result of a completed read; true iff there was one */
+static inline int cypress_read_consume(struct usb_cypress *dev)
+{
+  return atomic_cmpxchg_acquire(&dev->read_state, CYPRESS_URB_COMPLETED,
+				CYPRESS_URB_IDLE) == CYPRESS_URB_COMPLETED;
+}
+
 /* local function prototypes */
 int     addNode(struct usb_cypress *dev);
+struct usb_cypress *cypress_find_board(int serial);
 void    cypress_disconnect(struct usb_interface *interface);
 ssize_t cypress_get_bytes_read(int serial);
 ssize_t cypress_get_bytes_written(int serial);
@@ -125,12 +358,68 @@ ssize_t cypress_read(int serial, char *buffer, size_t count);
 void    cypress_read_bulk_callback(struct urb *urb, struct pt_regs *regs);
 ssize_t cypress_read_no_urb(int serial, char *buffer, size_t count);
 ssize_t cypress_request_read(int, char*, size_t);
+int     cypress_submit_read(struct usb_cypress *dev, char *buffer, size_t bytes_requested,
+			    cypress_done_t done, void *ctx);
+int     cypress_wait_read(struct usb_cypress *dev, unsigned int timeout_us);
+void    cypress_chain_read(struct usb_cypress *dev, int write_status);
+int     cypress_submit_exchange(struct usb_cypress *dev, const char *out, size_t out_len, char *in, size_t in_len,
+				struct usb_anchor *anchor, cypress_done_t done, void *ctx);
+int     cypress_start_stream(struct usb_cypress *dev, unsigned int num_urbs);
+void    cypress_stop_stream(struct usb_cypress *dev);
+int     cypress_stream_pending(struct usb_cypress *dev);
+int     cypress_wait_stream(struct usb_cypress *dev, unsigned int timeout_us);
+ssize_t cypress_stream_pop(struct usb_cypress *dev, unsigned char *buffer, size_t count,
+			   struct brl_usb_record *record, struct brl_usb_encoders *encoders);
+int     cypress_alloc_ring(struct usb_cypress *dev);
+void    cypress_ring_push(struct usb_cypress *dev, const void *data, size_t len,
+			  const struct cypress_stamp *stamp, const s64 *position);
+int     cypress_decode_encoders(struct usb_cypress *dev, const u8 *buf, size_t len, s64 *position);
+void    cypress_reset_encoders(struct usb_cypress *dev);
+void    cypress_reset_ring(struct usb_cypress *dev);
+void    cypress_publish_sample(struct usb_cypress *dev, const void *data, size_t len,
+			       const struct cypress_stamp *stamp);
+void    cypress_stamp_now(struct usb_cypress *dev, struct cypress_stamp *stamp);
+void    cypress_get_times(struct usb_cypress *dev, struct brl_usb_times *times);
+void    cypress_get_sample(struct usb_cypress *dev, struct brl_usb_sample *sample);
+void    cypress_free_ring(struct usb_cypress *dev);
 ssize_t cypress_write(int serial, const char *buffer, size_t count);
+ssize_t cypress_queue_write(struct usb_cypress *dev, const char *buffer, size_t count,
+			    cypress_done_t done, void *ctx);
+ssize_t cypress_write_mailbox(int serial, const char *buffer, size_t count);
+ssize_t cypress_queue_mailbox(struct usb_cypress *dev, const char *buffer, size_t count);
 void    cypress_write_bulk_callback(struct urb *urb, struct pt_regs *regs);
+int     cypress_alloc_write_slots(struct usb_cypress *dev);
+void    cypress_free_write_slots(struct usb_cypress *dev);
+void    cypress_kill_writes(struct usb_cypress *dev);
+int     cypress_write_ready(struct usb_cypress *dev);
+int     cypress_wait_write(struct usb_cypress *dev);
+void    cypress_cancel_exchange(struct usb_cypress *dev);
+void    cypress_repeat_mailbox(struct usb_cypress *dev);
 ssize_t cypress_write_no_urb(int serial, char *buffer, size_t count);
 int     getSerialNum(struct usb_cypress *dev);
 int     removeNode(struct usb_cypress *dev);
 void    traverseList(void);
-void    usb_cypress_debug_data (const char *function, int size, const unsigned char *data);
-int     cypress_reset_encdac(int);
+int     cypress_reset_board(struct usb_cypress *dev, int cmd, unsigned char *out, unsigned char *in,
+			    unsigned int timeout_us);
+
+/* in-kernel client API, exported */
+struct usb_cypress *cypress_get_board(int serial);
+void    cypress_put_board(struct usb_cypress *dev);
+int     cypress_board_exchange(struct usb_cypress *dev, const char *out, size_t out_len,
+			       char *in, size_t in_len, cypress_done_t done, void *ctx);
+void    cypress_add_listener(struct usb_cypress *dev, struct cypress_listener *l);
+void    cypress_remove_listener(struct usb_cypress *dev, struct cypress_listener *l);
+
+/* cypress_cycle.c */
+int     cypress_cycle_enable(struct usb_cypress *dev);
+void    cypress_cycle_disable(struct usb_cypress *dev);
+void    cypress_cycle_exit(void);
+
+/* cypress_stats.c */
+void    cypress_hist_add(struct cypress_hist *hist, u64 ns);
+extern const struct attribute_group *cypress_dev_groups[];
+void    cypress_stats_add_board(struct usb_cypress *dev);
+void    cypress_stats_remove_board(struct usb_cypress *dev);
+void    cypress_stats_init(void);
+void    cypress_stats_exit(void);
 
@@ -0,0 +1,167 @@
+/**
+ *  File: cypress_cycle.c
+ *
+ *  In-kernel cyclic exchange engine.  One hrtimer fires every
+ *  cycle_period_us and, for every board that has the cycle enabled, sends
+ *  the newest DAC mailbox packet followed by an ENC_REQ whose reply is
+ *  appended to the board's packet ring.  Userspace only publishes
+ *  setpoints (mailbox write mode) and consumes samples from the ring
+ *  (read(), poll() or the mmap()ed ring), so the bus timing no longer
+ *  depends on when the control process gets scheduled.
+ */
+
+#include "bulk_cypress.h"
+#include <linux/bitmap.h>
+#include <linux/moduleparam.h>
+
+static unsigned int cycle_period_us = 1000;
+module_param(cycle_period_us, uint, 0644);
+MODULE_PARM_DESC(cycle_period_us, "Period of the cycle engine in microseconds (default 1000, min 100)");
+
+#define CYPRESS_CYCLE_MIN_US 100
+
+static DECLARE_BITMAP(cycle_boards, MAX_BOARDS);  /* serials with the cycle enabled */
+static DEFINE_MUTEX(cycle_mutex);                  /* serializes enable/disable */
+static struct hrtimer cycle_timer;
+static int cycle_timer_ready;
+
+/* the encoder request sent every cycle; the board replies with ENC_READ */
+static const unsigned char cycle_req[USB_MAX_OUT_LEN] = { ENC_REQ };
+
+static ktime_t cycle_period(void)
+{
+  unsigned int us = max(READ_ONCE(cycle_period_us), (unsigned int)CYPRESS_CYCLE_MIN_US);
+
+  return ns_to_ktime((u64)us * NSEC_PER_USEC);
+}
+
+/**
+ * cypress_cycle_board - one tick for one board
+ *
+ * If the reply to the previous tick is still outstanding the board is
+ * skipped rather than queueing requests behind it.
+ */
+static void cypress_cycle_board(struct usb_cypress *dev)
+{
+  if (cypress_read_busy(dev))
+    {
+      dev->cycle_overruns++;
+      return;
+    }
+
+  cypress_repeat_mailbox(dev);
+  cypress_submit_exchange(dev, cycle_req, sizeof(cycle_req), NULL, USB_MAX_IN_LEN, NULL, NULL, NULL);
+}
+
+static enum hrtimer_restart cypress_cycle_tick(struct hrtimer *timer)
+{
+  struct usb_cypress *dev;
+  int serial;
+
+  rcu_read_lock();
+  for_each_set_bit(serial, cycle_boards, MAX_BOARDS)
+    {
+      dev = cypress_find_board(serial);
+      if (dev && atomic_read(&dev->cycling))
+	cypress_cycle_board(dev);
+    }
+  rcu_read_unlock();
+
+  /* skip ticks we missed instead of firing them back to back */
+  hrtimer_forward_now(timer, cycle_period());
+  return HRTIMER_RESTART;
+}
+
+/**
+ * cypress_cycle_enable
+ *
+ * Hand a board's read urb and packet ring to the cycle engine, starting
+ * the timer if this is the first board.  Not allowed while streaming.
+ *
+ *  result - 0 on success, negative error code on failure.
+ */
+int cypress_cycle_enable(struct usb_cypress *dev)
+{
+  int retval = 0;
+
+  mutex_lock(&dev->stream_mutex);
+  mutex_lock(&cycle_mutex);
+
+  if (!dev->present)
+    {
+      retval = -ENODEV;
+      goto exit;
+    }
+  if (atomic_read(&dev->cycling))
+    goto exit;
+  if (atomic_read(&dev->streaming) || cypress_read_busy(dev))
+    {
+      retval = -EBUSY;
+      goto exit;
+    }
+
+  cypress_reset_ring(dev);
+  dev->cycle_overruns = 0;
+
+  /* pairs with cypress_claim_read(), as in cypress_start_stream() */
+  atomic_set(&dev->cycling, 1);
+  smp_mb();
+  if (cypress_read_busy(dev))
+    {
+      atomic_set(&dev->cycling, 0);
+      retval = -EBUSY;
+      goto exit;
+    }
+  set_bit(dev->boardSerialNum, cycle_boards);
+
+  if (!cycle_timer_ready)
+    {
+      hrtimer_init(&cycle_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+      cycle_timer.function = cypress_cycle_tick;
+      cycle_timer_ready = 1;
+    }
+  if (!hrtimer_active(&cycle_timer))
+    hrtimer_start(&cycle_timer, cycle_period(), HRTIMER_MODE_REL);
+
+ exit:
+  mutex_unlock(&cycle_mutex);
+  mutex_unlock(&dev->stream_mutex);
+  return retval;
+}
+
+/**
+ * cypress_cycle_disable
+ *
+ * Take a board out of the cycle and wait until its last exchange is gone.
+ * The timer stops with the last board.  Safe to call when the board is
+ * not cycling.  May sleep.
+ */
+void cypress_cycle_disable(struct usb_cypress *dev)
+{
+  mutex_lock(&dev->stream_mutex);
+  mutex_lock(&cycle_mutex);
+
+  if (atomic_read(&dev->cycling))
+    {
+      atomic_set(&dev->cycling, 0);
+      clear_bit(dev->boardSerialNum, cycle_boards);
+      if (bitmap_empty(cycle_boards, MAX_BOARDS))
+	hrtimer_cancel(&cycle_timer);
+      synchronize_rcu();                    /* no tick is still looking at dev */
+      cypress_cancel_exchange(dev);
+      dev->read_to_ring = 0;                /* in case the request never got out */
+      wake_up_interruptible(&dev->read_wait);
+    }
+
+  mutex_unlock(&cycle_mutex);
+  mutex_unlock(&dev->stream_mutex);
+}
+
+/**
+ * cypress_cycle_exit - called on module unload, after every board is gone.
+ */
+void cypress_cycle_exit(void)
+{
+  if (cycle_timer_ready)
+    hrtimer_cancel(&cycle_timer);
+}
@@ -6,110 +6,166 @@
  */
 
 #include "bulk_cypress.h"
+#include "brl_usb_trace.h"
 
+static DEFINE_MUTEX(listener_mutex);   /* serializes updates of every dev->listeners */
 
-extern struct usb_cypress_node USBBoards[];
+/**
+ * cypress_claim_read
+ *
+ * Common checks of cypress_read() and cypress_request_read(), and the claim
+ * of read_urb.  The ring check comes after the claim: cypress_start_stream()
+ * and cypress_cycle_enable() set their flag before looking at read_state,
+ * so one of the two sides always sees the other.
+ *
+ *  result - the state read_urb was claimed from (see cypress_read_claim()),
+ *           or a negative error code.
+ */
+static int cypress_claim_read(struct usb_cypress *dev, size_t count, const char *who)
+{
+  int old;
+
+  /* verify that the device wasn't unplugged */
+  if( !dev->present )
+    {
+      cypress_error(dev, CYPRESS_ERR_UNPLUGGED, "Device unplugged (board %d)\n", dev->boardSerialNum);
+      return -ENODEV;
+    }
+
+  /* verify that we actually have some data to read */
+  if( count == 0 )
+    {
+      dbg("%s - read request of 0 bytes", who);
+      return -EFAULT;
+    }
+
+  /* a previous read must finish first; we don't use a timeout
+   * and so a nonresponsive device can delay us indefinitely.
+   */
+  old = cypress_read_claim(dev);
+  if( old < 0 )
+    {
+      cypress_error(dev, CYPRESS_ERR_BUSY, "%s already in progress (board %d)\n", who, dev->boardSerialNum);
+      return -EBUSY;
+    }
+  if( cypress_ring_active(dev) )
+    {
+      cypress_read_unclaim(dev, old);
+      cypress_error(dev, CYPRESS_ERR_BUSY, "%s while streaming (board %d)\n", who, dev->boardSerialNum);
+      return -EBUSY;
+    }
+  return old;
+}
 
 /**
  *    cypress_read
+ *
+ * Legacy synchronous read: hands back the data of the previous read_urb
+ * transfer and queues the next one.
  */
 ssize_t cypress_read(int serial, char *buffer, size_t count) 
 {
   ssize_t bytes_read = 0;
   int retval = 0;
+  int old;
   struct usb_cypress *dev = NULL;
 
   //Make sure the device is active
-  if( !USBBoards[serial].isActive )
+  rcu_read_lock();
+  dev = cypress_find_board(serial);
+  if( dev == NULL )
     {
-      printk(DRIVER_DESC ": Attempted to read from an invalid USB Board (%d)\n",serial);
+      rcu_read_unlock();
+      cypress_log("Attempted to read from an invalid USB Board (%d)\n",serial);
       return -EFAULT;
     }
-  dev = USBBoards[serial].data;
 
-  /* lock this object */
-  spin_lock(&dev->lock);
-  
-  /* verify that the device wasn't unplugged */
-  if( !dev->present )
+  old = cypress_claim_read(dev, count, "Read");
+  if( old < 0 )
     {
-      printk(DRIVER_DESC "Device unplugged (board %d)\n", serial);
-      retval= -ENODEV;
-    
-      /* unlock the device */
-      spin_unlock(&dev->lock);
-      return retval;
+      rcu_read_unlock();
+      return old;
     }
 
-  /* verify that we actually have some data to read */
-  if (count == 0)
-    {
-      dbg("%s - read request of 0 bytes", __FUNCTION__);
-      retval = -EFAULT;
-    
-      /* unlock the device */
-      spin_unlock(&dev->lock);
-      return retval;    
-    }
+  /* we can only read as much as our buffer will hold */
+  bytes_read = min( dev->bulk_in_size, count );
 
-  /* wait for a previous read to finish up; we don't use a timeout
-   * and so a nonresponsive device can delay us indefinitely.
+  /* copy the data from our transfer buffer into buffer before the next
+   * transfer overwrites it; this is the only copy required.
    */
-  if( atomic_read(&dev->read_busy) )
-    {
-      printk(DRIVER_DESC ": Read already in progress (board %d)\n", serial);
-      retval= -EBUSY;
+  memcpy(buffer, dev->read_urb->transfer_buffer, bytes_read);
 
-      /* unlock the device */
-      spin_unlock(&dev->lock);
-      return retval;
-    }
+  /* this urb was already set up, except for this read size; the
+   * callback has nowhere to copy to */
+  dev->read_urb->transfer_buffer_length = bytes_read;
+  dev->rt_buffer = NULL;
+  dev->read_done = NULL;
+  dev->read_actual_length = 0;
 
-  /* we can only read as much as our buffer will hold */
-  bytes_read = min( dev->bulk_in_size, count );
- 
   /* recieve the data from the bulk port */
-  /* a character device read uses GFP_KERNEL, unless a spinlock is held */
-  atomic_set( &dev->read_busy, 1 );
-  
+  dev->read_submit_ns = ktime_get_ns();
   retval = usb_submit_urb( dev->read_urb, GFP_ATOMIC );
+  trace_brl_usb_read_submit(serial, bytes_read, 0, retval);
   if( retval != 0 ) // URB submission unsuccessful
     {
-      atomic_set( &dev->read_busy, 0 );
-      printk(DRIVER_DESC ": Failed submitting read urb, error %d (board %d)\n", retval, serial);
-      return retval;
+      cypress_read_unclaim(dev, old);
+      cypress_error(dev, CYPRESS_ERR_URB, "Failed submitting read urb, error %d (board %d)\n", retval, serial);
     }
   else
     {
       retval = bytes_read;
     }
 
-  /* Debugging Information */
-  //printk(DRIVER_DESC ": DEBUG: actual_length %d\n", dev->read_urb->actual_length);
-  //printk(DRIVER_DESC ": DEBUG: status %d\n", dev->read_urb->status);
-  usb_cypress_debug_data (__FUNCTION__, bytes_read, dev->read_urb->transfer_buffer);
+  rcu_read_unlock();
+  return retval;
+}
 
-  /* copy the data from our transfer buffer into buffer;
-   * this is the only copy required.
-   * 
-   * this step should be executed in the callback
-   */
-  memcpy(buffer, dev->read_urb->transfer_buffer, bytes_read);
-  //printk(DRIVER_DESC ": DEBUG [cypress_read]: actual_length %d\n", dev->read_urb->actual_length);
 
+/**
+ * cypress_submit_read
+ *
+ * Submit read_urb for up to bytes_requested bytes; the callback copies the
+ * reply into buffer.  If done is given it is called from the completion
+ * handler, in interrupt context, with ctx, the urb status and the number
+ * of bytes received.
+ *
+ *  result - 0 on success, negative error code on failure.
+ */
+int cypress_submit_read(struct usb_cypress *dev, char *buffer, size_t bytes_requested,
+			cypress_done_t done, void *ctx)
+{
+  int retval = 0;
+  int old;
 
-  /* this urb was already set up, except for this read size */
-  dev->read_urb->transfer_buffer_length = bytes_read;
+  old = cypress_claim_read(dev, bytes_requested, "ReqRead");
+  if( old < 0 )
+    return old;
 
-  atomic_set( &dev->read_busy, 0 );
+  /* we can only read as much as our buffer will hold */
+  bytes_requested = min( dev->bulk_in_size, bytes_requested );
+  dev->read_urb->transfer_buffer_length = bytes_requested;
 
-  /* unlock the device */
-  spin_unlock(&dev->lock);
+  /* the callback may run before usb_submit_urb() returns */
+  dev->rt_buffer = buffer;
+  dev->read_done = done;
+  dev->read_done_ctx = ctx;
+  dev->read_actual_length = 0; // set to zero here, set to the length read in callback
 
+  /* recieve the data from the bulk port */
+  dev->read_submit_ns = ktime_get_ns();
+  retval = usb_submit_urb( dev->read_urb, GFP_ATOMIC );
+  trace_brl_usb_read_submit(dev->boardSerialNum, bytes_requested, 0, retval);
+
+  if( retval != 0 ) // URB submission unsuccessful
+    {
+      dev->read_done = NULL;
+      cypress_read_unclaim(dev, old);
+      cypress_error(dev, CYPRESS_ERR_URB, "Failed requesting read urb, error %d (board %d)\n",
+		    retval, dev->boardSerialNum);
+    }
   return retval;
 }
 
-
 /**
  * cypress_request_read
  *
@@ -126,103 +182,763 @@ ssize_t cypress_request_read(int serial, char *buffer, size_t bytes_requested)
   struct usb_cypress *dev = NULL;
 
   //Make sure the device is active
-  if( !USBBoards[serial].isActive )
+  rcu_read_lock();
+  dev = cypress_find_board(serial);
+  if( dev == NULL )
     {
-      printk(DRIVER_DESC ": Attempted to read from an invalid USB Board (%d)\n",serial);
+      rcu_read_unlock();
+      cypress_log("Attempted to read from an invalid USB Board (%d)\n",serial);
       return -EFAULT;
     }
-  dev = USBBoards[serial].data;
 
-  spin_lock(&dev->lock); /* lock the USB object */
-  
-  /* verify that the device wasn't unplugged */
-  if( !dev->present )
+  retval = cypress_submit_read(dev, buffer, bytes_requested, NULL, NULL);
+  rcu_read_unlock();
+  return retval;
+}
+
+/**
+ *	cypress_read_bulk_callback
+ */
+void cypress_read_bulk_callback (struct urb *urb, struct pt_regs *regs)
+{
+  struct usb_cypress *dev = (struct usb_cypress *)urb->context;
+  struct cypress_stamp *stamp = &dev->read_stamp;
+  cypress_done_t done = dev->read_done;          /* the next submitter may replace them */
+  void *done_ctx = dev->read_done_ctx;
+  int status = urb->status;
+  size_t len = urb->actual_length;
+
+  cypress_stamp_now(dev, stamp);
+  trace_brl_usb_read_complete(dev->boardSerialNum, urb->actual_length,
+			      urb->actual_length ? ((u8 *)urb->transfer_buffer)[0] : 0,
+			      urb->status);
+
+  /* sync/async unlink faults aren't errors */
+  if( urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET) )
     {
-      printk(DRIVER_DESC "Device unplugged (board %d)\n", serial);
-      retval= -ENODEV;
-    
-      spin_unlock(&dev->lock); /* unlock the device */
-      return retval;
+      dbg("%s - nonzero read bulk status received: %d", __FUNCTION__, urb->status);
+      atomic_long_inc(&dev->errors[CYPRESS_ERR_URB]);
+    }
+  else if( urb->status == 0 && urb->actual_length == 0 )
+    atomic_long_inc(&dev->errors[CYPRESS_ERR_SHORT]);
+  dev->read_status = urb->status;
+  dev->read_decoded = 0;
+  if( urb->status == 0 )
+    {
+      stamp->seq = atomic_inc_return(&dev->rx_seq);
+      cypress_hist_add(&dev->read_hist, stamp->ns - dev->read_submit_ns);
+      dev->read_decoded = cypress_decode_encoders(dev, urb->transfer_buffer, urb->actual_length,
+						  dev->read_position);
+      if( urb->actual_length )
+	cypress_publish_sample(dev, urb->transfer_buffer, urb->actual_length, stamp);
     }
 
-  /* verify that we actually have some data to read */
-  if (bytes_requested == 0)
+  dev->read_actual_length = urb->actual_length;  /* update value with the number of bytes read */
+  if( dev->read_to_ring )                        /* a cycle engine read */
     {
-      dbg("%s - read request of 0 bytes", __FUNCTION__);
-      retval = -EFAULT;
-    
-      spin_unlock(&dev->lock); /* unlock the device */
-      return retval;    
+      dev->read_to_ring = 0;
+      if( urb->status == 0 )
+	cypress_ring_push(dev, urb->transfer_buffer, urb->actual_length, stamp,
+			  dev->read_decoded ? dev->read_position : NULL);
+      atomic_cmpxchg_release(&dev->read_state, CYPRESS_URB_SUBMITTED, CYPRESS_URB_IDLE);
     }
+  else
+    {
+      if( dev->rt_buffer )
+	memcpy(dev->rt_buffer,
+	       urb->transfer_buffer,
+	       urb->actual_length);              /* copy data to output buffer */
+      /* publish the results above to whoever waits for the state */
+      dev->read_done = NULL;
+      atomic_cmpxchg_release(&dev->read_state, CYPRESS_URB_SUBMITTED, CYPRESS_URB_COMPLETED);
+    }
+  wake_up_interruptible_poll(&dev->read_wait, EPOLLIN | EPOLLRDNORM);
 
-  /* wait for a previous read to finish up; we don't use a timeout
-   * and so a nonresponsive device can delay us indefinitely.
-   */
-  if( atomic_read(&dev->read_busy) )
+  if( done )
+    done(done_ctx, status, len);
+}
+
+/**
+ * cypress_chain_read
+ *
+ * Called from the write callback of an exchange started by
+ * cypress_submit_exchange().  The read urb was set up when the exchange was
+ * submitted; send it now that the OUT packet is on the wire, or release it
+ * (waking the waiter with no data, and calling its done hook) if the write
+ * failed.
+ */
+void cypress_chain_read(struct usb_cypress *dev, int write_status)
+{
+  int retval = write_status;
+  int to_ring;
+  cypress_done_t done;
+  void *done_ctx;
+
+  if( retval == 0 )
     {
-      printk(DRIVER_DESC ": ReqRead already in progress (board %d)\n", serial);
-      retval= -EBUSY;
-      spin_unlock(&dev->lock); /* unlock the device */
-      return retval;
+      dev->read_submit_ns = ktime_get_ns();
+      retval = usb_submit_urb(dev->read_urb, GFP_ATOMIC);
+      trace_brl_usb_read_submit(dev->boardSerialNum,
+				dev->read_urb->transfer_buffer_length, 0, retval);
     }
 
-  /* recieve the data from the bulk port */
-  atomic_set( &dev->read_busy, 1 );
+  if( retval != 0 )
+    {
+      to_ring = dev->read_to_ring;
+      done = dev->read_done;
+      done_ctx = dev->read_done_ctx;
+      dev->read_to_ring = 0;
+      dev->read_done = NULL;
+      dev->read_actual_length = 0;
+      dev->read_status = retval;
+      atomic_cmpxchg_release(&dev->read_state, CYPRESS_URB_SUBMITTED,
+			     to_ring ? CYPRESS_URB_IDLE : CYPRESS_URB_COMPLETED);
+      wake_up_interruptible_poll(&dev->read_wait, EPOLLIN | EPOLLRDNORM);
+      if( done )
+	done(done_ctx, retval, 0);
+    }
+}
 
-  /* we can only read as much as our buffer will hold */
-  bytes_requested = min( dev->bulk_in_size, bytes_requested );
-  dev->read_urb->transfer_buffer_length = bytes_requested;
-  
-  /* disable IRQs for this processor */
-  //  disable_irq_nosync(0);
+/**
+ * cypress_wait_read
+ *
+ * Sleep until the outstanding read urb on dev has completed.  The read
+ * callback wakes us directly, so we return as soon as the data has landed
+ * instead of polling on a jiffy timeout.
+ *
+ * timeout_us - high resolution timeout in microseconds, or 0 to wait
+ *              until the urb completes.
+ *
+ *  result - 0 on completion, -ETIME on timeout, -ERESTARTSYS on signal.
+ */
+int cypress_wait_read(struct usb_cypress *dev, unsigned int timeout_us)
+{
+  if( timeout_us == 0 )
+    {
+      return wait_event_interruptible(dev->read_wait,
+				      !cypress_read_busy(dev));
+    }
 
-  /* a character device read uses GFP_KERNEL, unless a spinlock is held */
-  retval = usb_submit_urb( dev->read_urb, GFP_ATOMIC );
+  return wait_event_interruptible_hrtimeout(dev->read_wait,
+					    !cypress_read_busy(dev),
+					    ns_to_ktime((u64)timeout_us * NSEC_PER_USEC));
+}
 
-  /* restore irqs */
-  //  enable_irq(0);
+/**
+ * cypress_alloc_ring
+ *
+ * Allocate the per-board packet ring and latest-sample page.  Both live in
+ * vmalloc_user() memory so that test_mmap() can hand them to userspace;
+ * the completion handlers write received packets straight into them.
+ *
+ *  result - 0 on success, -ENOMEM on failure.
+ */
+int cypress_alloc_ring(struct usb_cypress *dev)
+{
+  dev->ring_area = vmalloc_user(BRL_USB_RING_MAP_SIZE);
+  if( dev->ring_area == NULL )
+    return -ENOMEM;
+
+  dev->ring = dev->ring_area;
+  dev->ring_slots = dev->ring_area + BRL_USB_RING_DATA_OFFSET;
+  dev->ring->num_slots = BRL_USB_RING_SLOTS;
+  dev->ring->slot_size = sizeof(struct brl_usb_slot);
+  dev->ring->data_offset = BRL_USB_RING_DATA_OFFSET;
+
+  /* the snapshot gets its own page so it can be mapped read-only */
+  dev->sample = vmalloc_user(BRL_USB_SAMPLE_MAP_SIZE);
+  if( dev->sample == NULL )
+    return -ENOMEM;
+  return 0;
+}
 
-  if( retval != 0 ) // URB submission unsuccessful
+/**
+ * cypress_free_ring - release the packet ring and sample page.  Pages still mapped by a
+ * process stay valid until it unmaps them.
+ */
+void cypress_free_ring(struct usb_cypress *dev)
+{
+  vfree(dev->sample);
+  dev->sample = NULL;
+  vfree(dev->ring_area);
+  dev->ring_area = NULL;
+  dev->ring = NULL;
+  dev->ring_slots = NULL;
+}
+
+/**
+ * ring_pending - number of filled slots between the consumer's tail and
+ * head.  tail is writable by userspace, so clamp whatever we find there.
+ */
+static unsigned int ring_pending(struct usb_cypress *dev)
+{
+  unsigned int tail = smp_load_acquire(&dev->ring->tail);
+  unsigned int pending = dev->stream_head - tail;
+
+  return min(pending, (unsigned int)BRL_USB_RING_SLOTS);
+}
+
+/**
+ * cypress_ring_push
+ *
+ * Append one received packet, with its sequence number, completion time
+ * and frame and its decoded encoders (position may be NULL), to the shared
+ * ring and wake readers.  When the ring is full the
+ * packet is dropped and counted.  Called from urb completion handlers.
+ */
+void cypress_ring_push(struct usb_cypress *dev, const void *data, size_t len,
+		       const struct cypress_stamp *stamp, const s64 *position)
+{
+  struct brl_usb_slot *slot;
+  unsigned long flags;
+
+  spin_lock_irqsave(&dev->ring_lock, flags);
+  if( ring_pending(dev) >= BRL_USB_RING_SLOTS )
     {
-      atomic_set( &dev->read_busy, 0 );
-      printk(DRIVER_DESC ": Failed requesting read urb, error %d (board %d)\n", retval, serial);
+      dev->ring->overruns++;
     }
   else
     {
-      dev->rt_buffer = buffer;
-      dev->read_actual_length = 0; // set to zero here, set to the length read in callback
+      slot = &dev->ring_slots[dev->stream_head % BRL_USB_RING_SLOTS];
+      slot->length = min_t(u32, len, BRL_USB_PACKET_LEN);
+      slot->seq = stamp->seq;
+      slot->timestamp_ns = stamp->ns;
+      slot->frame = stamp->frame;
+      slot->flags = 0;
+      if( position )
+	{
+	  slot->flags = BRL_USB_SLOT_DECODED;
+	  memcpy(slot->position, position, sizeof(slot->position));
+	}
+      memcpy(slot->data, data, slot->length);
+      dev->stream_head++;
+      smp_store_release(&dev->ring->head, dev->stream_head);  /* publish after the slot */
     }
+  spin_unlock_irqrestore(&dev->ring_lock, flags);
 
-  spin_unlock(&dev->lock); /* unlock the device */
-  return retval;
+  wake_up_interruptible_poll(&dev->read_wait, EPOLLIN | EPOLLRDNORM);
 }
 
 /**
- *	cypress_read_bulk_callback
+ * cypress_publish_sample
+ *
+ * Replace the latest-sample snapshot with a newly received packet.  The
+ * snapshot is shared with userspace, so instead of a seqcount_t embedded
+ * in struct usb_cypress the sequence lives in the page itself; the
+ * protocol is the same as raw_write_seqcount_begin()/end().  Called from
+ * urb completion handlers; never blocks readers.  Also records the
+ * packet as the board's last IN transfer for cypress_get_times() and
+ * hands it to the in-kernel listeners.
  */
-void cypress_read_bulk_callback (struct urb *urb, struct pt_regs *regs)
+void cypress_publish_sample(struct usb_cypress *dev, const void *data, size_t len,
+			    const struct cypress_stamp *stamp)
+{
+  struct brl_usb_sample *s = dev->sample;
+  struct cypress_listener *l;
+  unsigned long flags;
+  u32 seq;
+
+  len = min_t(size_t, len, BRL_USB_PACKET_LEN);
+
+  spin_lock_irqsave(&dev->sample_lock, flags);
+  seq = s->seq;
+  WRITE_ONCE(s->seq, seq + 1);
+  smp_wmb();
+  s->timestamp_ns = stamp->ns;
+  s->frame = stamp->frame;
+  s->count++;
+  s->length = len;
+  memcpy(s->data, data, len);
+  smp_wmb();
+  WRITE_ONCE(s->seq, seq + 2);
+  spin_unlock_irqrestore(&dev->sample_lock, flags);
+
+  write_seqlock_irqsave(&dev->in_stamp_lock, flags);
+  dev->in_stamp = *stamp;
+  write_sequnlock_irqrestore(&dev->in_stamp_lock, flags);
+
+  rcu_read_lock();
+  list_for_each_entry_rcu(l, &dev->listeners, node)
+    l->sample(l, data, len, stamp);
+  rcu_read_unlock();
+}
+
+/**
+ * cypress_add_listener
+ *
+ * Have l->sample() called with every packet the board receives, on the
+ * read urb, the stream urbs or the cycle engine, and its completion stamp.
+ * l->sample() runs in the urb completion handler and must not sleep;
+ * this function itself may.
+ */
+void cypress_add_listener(struct usb_cypress *dev, struct cypress_listener *l)
+{
+  mutex_lock(&listener_mutex);
+  list_add_tail_rcu(&l->node, &dev->listeners);
+  mutex_unlock(&listener_mutex);
+}
+
+/**
+ * cypress_remove_listener
+ *
+ * Undo cypress_add_listener().  Waits until no completion handler can
+ * still be calling l, so it may be freed on return.  May sleep.
+ */
+void cypress_remove_listener(struct usb_cypress *dev, struct cypress_listener *l)
+{
+  mutex_lock(&listener_mutex);
+  list_del_rcu(&l->node);
+  mutex_unlock(&listener_mutex);
+  synchronize_rcu();
+}
+
+/**
+ * cypress_get_sample
+ *
+ * Take a consistent copy of the latest-sample snapshot, retrying while a
+ * completion handler is updating it.  Lock free; any number of readers.
+ */
+void cypress_get_sample(struct usb_cypress *dev, struct brl_usb_sample *sample)
+{
+  struct brl_usb_sample *s = dev->sample;
+  u32 seq;
+
+  do
+    {
+      seq = smp_load_acquire(&s->seq);
+      if( seq & 1 )
+	{
+	  cpu_relax();
+	  continue;
+	}
+      memcpy(sample, s, sizeof(*sample));
+      smp_rmb();
+    }
+  while( (seq & 1) || READ_ONCE(s->seq) != seq );
+}
+
+/**
+ * cypress_stamp_now
+ *
+ * Take the monotonic time and the bus frame number as close together as
+ * we can.  Called first thing in the completion handlers, so the stamp
+ * tells when the transfer finished rather than when anyone looked at it.
+ * usb_get_current_frame_number() only reads a host controller register
+ * and is safe in interrupt context; hosts that cannot tell give frame 0.
+ */
+void cypress_stamp_now(struct usb_cypress *dev, struct cypress_stamp *stamp)
+{
+  int frame = usb_get_current_frame_number(dev->udev);
+
+  stamp->ns = ktime_get_ns();
+  stamp->frame = frame < 0 ? 0 : frame;
+}
+
+/**
+ * cypress_get_times - fill in a BRL_USB_IOC_GET_TIMES reply.
+ */
+void cypress_get_times(struct usb_cypress *dev, struct brl_usb_times *times)
+{
+  struct cypress_stamp now, in, out;
+  unsigned int seq;
+
+  memset(times, 0, sizeof(*times));
+  cypress_stamp_now(dev, &now);
+  do
+    {
+      seq = read_seqbegin(&dev->in_stamp_lock);
+      in = dev->in_stamp;
+    }
+  while( read_seqretry(&dev->in_stamp_lock, seq) );
+  do
+    {
+      seq = read_seqbegin(&dev->out_stamp_lock);
+      out = dev->out_stamp;
+      times->out_length = dev->write_actual_length;
+    }
+  while( read_seqretry(&dev->out_stamp_lock, seq) );
+
+  times->now_ns = now.ns;
+  times->now_frame = now.frame;
+  times->in_ns = in.ns;
+  times->in_frame = in.frame;
+  times->in_seq = in.seq;
+  times->out_ns = out.ns;
+  times->out_frame = out.frame;
+}
+
+/**
+ * cypress_decode_encoders
+ *
+ * Decode the eight 24-bit LS7266R1 counts of an ENC_READ/ENC_VEL packet
+ * (little endian, from byte 3 on) in one pass straight from the urb
+ * buffer, and unwrap them against the previous packet: the difference of
+ * two counts modulo 2^24 is taken as a signed step, so a counter rolling
+ * over in either direction keeps a continuous 64-bit position.  Called
+ * from the completion handlers, in arrival order.
+ *
+ *  result - true iff buf was an encoder packet; position then holds the
+ *           unwrapped counts.
+ */
+int cypress_decode_encoders(struct usb_cypress *dev, const u8 *buf, size_t len, s64 *position)
+{
+  struct cypress_encoders *enc = &dev->enc;
+  unsigned long flags;
+  u32 raw;
+  int ch;
+
+  if( len < 3 + 3 * BRL_USB_ENC_CHANNELS || (buf[0] != ENC_READ && buf[0] != ENC_VEL) )
+    return 0;
+
+  spin_lock_irqsave(&dev->sample_lock, flags);
+  for( ch = 0; ch < BRL_USB_ENC_CHANNELS; ch++ )
+    {
+      raw = buf[3*ch+3] | (buf[3*ch+4] << 8) | (buf[3*ch+5] << 16);
+      if( enc->valid )
+	enc->position[ch] += sign_extend32(raw - enc->last[ch], 23);
+      else
+	enc->position[ch] = sign_extend32(raw, 23);
+      enc->last[ch] = raw;
+      position[ch] = enc->position[ch];
+    }
+  enc->valid = 1;
+  spin_unlock_irqrestore(&dev->sample_lock, flags);
+  return 1;
+}
+
+/**
+ * cypress_reset_encoders - restart wrap tracking, e.g. after the board's
+ * counters were reset.  The next packet's counts are taken as they are.
+ */
+void cypress_reset_encoders(struct usb_cypress *dev)
+{
+  unsigned long flags;
+
+  spin_lock_irqsave(&dev->sample_lock, flags);
+  dev->enc.valid = 0;
+  spin_unlock_irqrestore(&dev->sample_lock, flags);
+}
+
+/**
+ * cypress_reset_ring - empty the ring before a new producer starts.
+ */
+void cypress_reset_ring(struct usb_cypress *dev)
+{
+  unsigned long flags;
+
+  spin_lock_irqsave(&dev->ring_lock, flags);
+  dev->stream_head = 0;
+  dev->ring->head = 0;
+  dev->ring->tail = 0;
+  dev->ring->overruns = 0;
+  spin_unlock_irqrestore(&dev->ring_lock, flags);
+}
+
+/**
+ *	cypress_stream_callback
+ *
+ * Completion handler for the stream urbs.  Writes the packet into the
+ * next slot of the shared ring and immediately resubmits the urb, so that
+ * another transfer is already queued on the bus while this one is being
+ * consumed.  When the ring is full the packet is dropped and counted.
+ * Transfer errors (-EPROTO, -EILSEQ, -ETIME, ...) are counted and the urb
+ * resubmitted; it is only retired once it was killed or the device is
+ * gone.  When the last one retires streaming is cleared and sleeping
+ * readers are woken, so they see the end of the stream.
+ */
+static void cypress_stream_callback (struct urb *urb)
 {
   struct usb_cypress *dev = (struct usb_cypress *)urb->context;
- 
-  /* sync/async unlink faults aren't errors */
-  if( urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET) )
+  s64 position[BRL_USB_ENC_CHANNELS];
+  struct cypress_stamp stamp;
+  int decoded;
+
+  cypress_stamp_now(dev, &stamp);
+
+  trace_brl_usb_read_complete(dev->boardSerialNum, urb->actual_length,
+			      urb->actual_length ? ((u8 *)urb->transfer_buffer)[0] : 0,
+			      urb->status);
+
+  switch( urb->status )
     {
-      dbg("%s - nonzero read bulk status received: %d", __FUNCTION__, urb->status);
+    case 0:
+      break;
+    case -ENOENT:        /* killed by cypress_stop_stream() */
+    case -ECONNRESET:
+    case -ESHUTDOWN:     /* device gone */
+    case -ENODEV:
+      goto retire;
+    default:
+      dbg("%s - nonzero stream bulk status received: %d", __FUNCTION__, urb->status);
+      atomic_long_inc(&dev->errors[CYPRESS_ERR_URB]);
+      goto resubmit;
     }
 
-  memcpy(dev->rt_buffer, 
-	 urb->transfer_buffer, 
-	 urb->actual_length);                    /* copy data to output buffer */
-  dev->read_actual_length = urb->actual_length;  /* update value with the number of bytes read */
-  atomic_set (&dev->read_busy, 0);               /* notify anyone waiting that the read has finished */
+  if( urb->actual_length == 0 )
+    atomic_long_inc(&dev->errors[CYPRESS_ERR_SHORT]);
+
+  stamp.seq = atomic_inc_return(&dev->rx_seq);
+  decoded = cypress_decode_encoders(dev, urb->transfer_buffer, urb->actual_length, position);
+  if( urb->actual_length )
+    cypress_publish_sample(dev, urb->transfer_buffer, urb->actual_length, &stamp);
+  cypress_ring_push(dev, urb->transfer_buffer, urb->actual_length, &stamp,
+		    decoded ? position : NULL);
+
+ resubmit:
+  if( !atomic_read(&dev->streaming) )
+    goto retire;
+
+  usb_anchor_urb(urb, &dev->stream_anchor);
+  if( usb_submit_urb(urb, GFP_ATOMIC) == 0 )
+    return;
+  usb_unanchor_urb(urb);
+  cypress_error(dev, CYPRESS_ERR_URB, "Failed resubmitting stream urb (board %d)\n", dev->boardSerialNum);
+
+ retire:
+  if( atomic_dec_and_test(&dev->stream_live) )
+    {
+      atomic_set(&dev->streaming, 0);
+      wake_up_interruptible(&dev->read_wait);
+    }
+}
+
+/**
+ * cypress_free_stream - release the stream urbs.
+ * Called with stream_mutex held once no stream urb is in flight.
+ */
+static void cypress_free_stream(struct usb_cypress *dev)
+{
+  int i;
+
+  for( i = 0; i < dev->stream_num_urbs; i++ )
+    {
+      struct urb *urb = dev->stream_urbs[i];
+      if( urb == NULL )
+	continue;
+      usb_free_coherent(dev->udev, dev->bulk_in_size,
+			urb->transfer_buffer, urb->transfer_dma);
+      usb_free_urb(urb);
+      dev->stream_urbs[i] = NULL;
+    }
+  dev->stream_num_urbs = 0;
+}
+
+/**
+ * cypress_start_stream
+ *
+ * Switch a board into continuous streaming mode: num_urbs IN urbs are
+ * submitted and kept anchored, each one resubmitted from its completion
+ * handler after filling a slot of the shared packet ring.  The single read_urb is not
+ * used while streaming.
+ *
+ *  result - 0 on success, negative error code on failure.
+ */
+int cypress_start_stream(struct usb_cypress *dev, unsigned int num_urbs)
+{
+  int i, retval = 0;
+
+  if( num_urbs == 0 )
+    num_urbs = CYPRESS_STREAM_DEFAULT_URBS;
+  if( num_urbs > CYPRESS_STREAM_URBS )
+    return -EINVAL;
 
-  /*  if (atomic_read( &dev->fs_read_busy ) &&
-      (dev->read_task != NULL) && 
-      dev->read_task->state >= 0 )   // running,runnable,interruptable,uninterruptable 
+  mutex_lock(&dev->stream_mutex);
+
+  if( !dev->present )
+    {
+      retval = -ENODEV;
+      goto exit;
+    }
+  if( cypress_ring_active(dev) || cypress_read_busy(dev) )
+    {
+      retval = -EBUSY;
+      goto exit;
+    }
+
+  /* urbs left over from a stream whose urbs all retired on their own */
+  cypress_free_stream(dev);
+  cypress_reset_ring(dev);
+  init_usb_anchor(&dev->stream_anchor);
+  atomic_set(&dev->stream_live, 0);
+
+  for( i = 0; i < num_urbs; i++ )
+    {
+      struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
+      unsigned char *buf;
+
+      if( urb == NULL )
+	{
+	  retval = -ENOMEM;
+	  goto error;
+	}
+      dev->stream_urbs[dev->stream_num_urbs++] = urb;
+
+      buf = usb_alloc_coherent(dev->udev, dev->bulk_in_size, GFP_KERNEL, &urb->transfer_dma);
+      if( buf == NULL )
+	{
+	  retval = -ENOMEM;
+	  goto error;
+	}
+      usb_fill_bulk_urb(urb, dev->udev,
+			usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+			buf, dev->bulk_in_size,
+			cypress_stream_callback, dev);
+      urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    }
+
+  /* pairs with cypress_claim_read(): a reader that claimed read_urb
+   * before seeing streaming set is seen here */
+  atomic_set(&dev->streaming, 1);
+  smp_mb();                  /* atomic_set() is a plain store */
+  if( cypress_read_busy(dev) )
     {
-      wake_up_process(dev->read_task);
+      atomic_set(&dev->streaming, 0);
+      retval = -EBUSY;
+      goto error;
     }
-*/
+  for( i = 0; i < dev->stream_num_urbs; i++ )
+    {
+      usb_anchor_urb(dev->stream_urbs[i], &dev->stream_anchor);
+      atomic_inc(&dev->stream_live);
+      retval = usb_submit_urb(dev->stream_urbs[i], GFP_KERNEL);
+      if( retval != 0 )
+	{
+	  usb_unanchor_urb(dev->stream_urbs[i]);
+	  atomic_dec(&dev->stream_live);
+	  printk(DRIVER_DESC ": Failed submitting stream urb, error %d (board %d)\n",
+		 retval, dev->boardSerialNum);
+	  atomic_set(&dev->streaming, 0);
+	  usb_kill_anchored_urbs(&dev->stream_anchor);
+	  goto error;
+	}
+    }
+  goto exit;
+
+ error:
+  cypress_free_stream(dev);
+ exit:
+  mutex_unlock(&dev->stream_mutex);
+  return retval;
+}
+
+/**
+ * cypress_stop_stream
+ *
+ * Leave streaming mode: kill and free the in-flight stream urbs and drop
+ * the packets still in the ring, as BRL_USB_IOC_STREAM_OFF documents.
+ * Safe to call when the board is not streaming, or when its stream urbs
+ * already retired on their own.  May sleep.
+ */
+void cypress_stop_stream(struct usb_cypress *dev)
+{
+  mutex_lock(&dev->stream_mutex);
+  if( dev->stream_num_urbs )
+    {
+      atomic_set(&dev->streaming, 0);
+      usb_poison_anchored_urbs(&dev->stream_anchor);
+      cypress_free_stream(dev);
+      cypress_reset_ring(dev);
+      wake_up_interruptible(&dev->read_wait);
+    }
+  mutex_unlock(&dev->stream_mutex);
+}
+
+/**
+ * cypress_stream_pending - number of packets waiting in the stream ring
+ */
+int cypress_stream_pending(struct usb_cypress *dev)
+{
+  unsigned long flags;
+  int pending;
+
+  spin_lock_irqsave(&dev->ring_lock, flags);
+  pending = ring_pending(dev);
+  spin_unlock_irqrestore(&dev->ring_lock, flags);
+  return pending;
+}
+
+/**
+ * cypress_wait_stream
+ *
+ * Sleep until the stream ring holds a packet or its producer (streaming
+ * or the cycle engine) is stopped.
+ * Same timeout convention and result as cypress_wait_read().
+ */
+int cypress_wait_stream(struct usb_cypress *dev, unsigned int timeout_us)
+{
+  if( timeout_us == 0 )
+    {
+      return wait_event_interruptible(dev->read_wait,
+				      cypress_stream_pending(dev) ||
+				      !cypress_ring_active(dev));
+    }
+
+  return wait_event_interruptible_hrtimeout(dev->read_wait,
+					    cypress_stream_pending(dev) ||
+					    !cypress_ring_active(dev),
+					    ns_to_ktime((u64)timeout_us * NSEC_PER_USEC));
+}
+
+/**
+ * cypress_stream_pop
+ *
+ * Copy the oldest packet out of the stream ring into buffer (at most count
+ * bytes) and release its slot.  If record is given it is filled in with
+ * the packet's sequence number, timestamp and full length.  If encoders
+ * is given the packet's decoded positions are returned there instead of
+ * its bytes, or -ENODATA, leaving the packet in the ring, if it was not an
+ * encoder packet.
+ *
+ *  result - number of bytes copied, or -EAGAIN if the ring is empty.
+ */
+ssize_t cypress_stream_pop(struct usb_cypress *dev, unsigned char *buffer, size_t count,
+			   struct brl_usb_record *record, struct brl_usb_encoders *encoders)
+{
+  struct brl_usb_slot *slot;
+  unsigned long flags;
+  unsigned int tail;
+  ssize_t len = -EAGAIN;
+
+  spin_lock_irqsave(&dev->ring_lock, flags);
+  if( ring_pending(dev) > 0 )
+    {
+      tail = dev->stream_head - ring_pending(dev);
+      slot = &dev->ring_slots[tail % BRL_USB_RING_SLOTS];
+      if( encoders )
+	{
+	  if( !(slot->flags & BRL_USB_SLOT_DECODED) )
+	    {
+	      len = -ENODATA;
+	      goto unlock;
+	    }
+	  encoders->serial = dev->boardSerialNum;
+	  encoders->seq = slot->seq;
+	  encoders->timestamp_ns = slot->timestamp_ns;
+	  encoders->frame = slot->frame;
+	  encoders->reserved = 0;
+	  memcpy(encoders->position, slot->position, sizeof(encoders->position));
+	  len = sizeof(*encoders);
+	}
+      else
+	{
+	  len = min_t(size_t, slot->length, count);
+	  memcpy(buffer, slot->data, len);
+	}
+      if( record )
+	{
+	  record->serial = dev->boardSerialNum;
+	  record->seq = slot->seq;
+	  record->timestamp_ns = slot->timestamp_ns;
+	  record->frame = slot->frame;
+	  record->reserved = 0;
+	  record->actual_length = slot->length;
+	  record->status = 0;
+	}
+      smp_store_release(&dev->ring->tail, tail + 1);
+    }
+ unlock:
+  spin_unlock_irqrestore(&dev->ring_lock, flags);
+  return len;
 }
 
 /**
@@ -240,14 +956,17 @@ void cypress_read_bulk_callback (struct urb *urb, struct pt_regs *regs)
  */
 ssize_t  cypress_get_bytes_read(int serialNum)
 {
+  struct usb_cypress *dev;
+  ssize_t bytes_read = -ENODEV;
+
   // Check if the board as active
-  if( USBBoards[serialNum].isActive == TRUE )
+  rcu_read_lock();
+  dev = cypress_find_board(serialNum);
+  if( dev != NULL )
     {
-      return USBBoards[serialNum].data->read_actual_length; 
-    }
-  else
-    {
-      return -ENODEV;
+      bytes_read = dev->read_actual_length; 
     }
+  rcu_read_unlock();
+  return bytes_read;
 }
 
@@ -0,0 +1,189 @@
+/**
+ *  File: cypress_stats.c
+ *
+ *  Per-board transfer statistics.  URB round-trip times are collected
+ *  into lock-free log2 histograms and exposed through debugfs:
+ *
+ *    /sys/kernel/debug/brl_usb/<serial>/read_latency
+ *    /sys/kernel/debug/brl_usb/<serial>/write_latency
+ *    /sys/kernel/debug/brl_usb/<serial>/reset         (write anything)
+ *
+ *  Error counters by class (enum cypress_err) are plain sysfs attributes
+ *  of the board's interface, so they are there without debugfs:
+ *
+ *    /sys/bus/usb/devices/<interface>/errors/{busy,unplugged,short_transfer,urb}
+ */
+
+#include "bulk_cypress.h"
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+static struct dentry *cypress_debugfs_root;
+
+/**
+ * cypress_hist_add - account one round trip of ns nanoseconds
+ *
+ * Called from the bulk callbacks, so it only uses atomics.  Bucket i holds
+ * samples in [2^i, 2^(i+1)) ns.
+ */
+void cypress_hist_add(struct cypress_hist *hist, u64 ns)
+{
+  int bucket = ns ? fls64(ns) - 1 : 0;
+  s64 max = atomic64_read(&hist->max_ns);
+
+  if( bucket >= CYPRESS_HIST_BUCKETS )
+    bucket = CYPRESS_HIST_BUCKETS - 1;
+
+  atomic64_inc(&hist->bucket[bucket]);
+  atomic64_inc(&hist->count);
+  while( (s64)ns > max && !atomic64_try_cmpxchg(&hist->max_ns, &max, ns) )
+    ;
+}
+
+static void cypress_hist_reset(struct cypress_hist *hist)
+{
+  int i;
+
+  for( i = 0; i < CYPRESS_HIST_BUCKETS; i++ )
+    atomic64_set(&hist->bucket[i], 0);
+  atomic64_set(&hist->count, 0);
+  atomic64_set(&hist->max_ns, 0);
+}
+
+/**
+ * hist_percentile - upper bound (ns) of the bucket holding the pct'th
+ * percentile sample, clamped to the largest sample seen.
+ */
+static u64 hist_percentile(struct cypress_hist *hist, u64 count, int pct)
+{
+  u64 rank = div_u64(count * pct + 99, 100);
+  u64 seen = 0;
+  u64 max = atomic64_read(&hist->max_ns);
+  int i;
+
+  for( i = 0; i < CYPRESS_HIST_BUCKETS; i++ )
+    {
+      seen += atomic64_read(&hist->bucket[i]);
+      if( seen >= rank )
+	return min((1ULL << (i + 1)) - 1, max);
+    }
+  return max;
+}
+
+static int hist_show(struct seq_file *m, void *unused)
+{
+  struct cypress_hist *hist = m->private;
+  u64 count = atomic64_read(&hist->count);
+  int i;
+
+  seq_printf(m, "samples: %llu\n", count);
+  if( count == 0 )
+    return 0;
+
+  seq_printf(m, "p50: %llu ns\n", hist_percentile(hist, count, 50));
+  seq_printf(m, "p99: %llu ns\n", hist_percentile(hist, count, 99));
+  seq_printf(m, "max: %llu ns\n", (u64)atomic64_read(&hist->max_ns));
+
+  for( i = 0; i < CYPRESS_HIST_BUCKETS; i++ )
+    {
+      s64 n = atomic64_read(&hist->bucket[i]);
+      if( n )
+	seq_printf(m, "%12llu ns: %lld\n", 1ULL << i, n);
+    }
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hist);
+
+static ssize_t reset_write(struct file *pfile, const char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+  struct usb_cypress *dev = pfile->private_data;
+
+  cypress_hist_reset(&dev->read_hist);
+  cypress_hist_reset(&dev->write_hist);
+  return count;
+}
+
+static const struct file_operations reset_fops = {
+  .owner =	THIS_MODULE,
+  .open =	simple_open,
+  .write =	reset_write,
+  .llseek =	noop_llseek,
+};
+
+static ssize_t error_show(struct device *d, char *buf, int class)
+{
+  struct usb_cypress *dev = usb_get_intfdata(to_usb_interface(d));
+
+  if( dev == NULL )
+    return -ENODEV;
+  return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->errors[class]));
+}
+
+#define CYPRESS_ERROR_ATTR(name, class)					\
+  static ssize_t name##_show(struct device *d, struct device_attribute *attr, char *buf) \
+  {									\
+    return error_show(d, buf, class);					\
+  }									\
+  static DEVICE_ATTR_RO(name)
+
+CYPRESS_ERROR_ATTR(busy, CYPRESS_ERR_BUSY);
+CYPRESS_ERROR_ATTR(unplugged, CYPRESS_ERR_UNPLUGGED);
+CYPRESS_ERROR_ATTR(short_transfer, CYPRESS_ERR_SHORT);
+CYPRESS_ERROR_ATTR(urb, CYPRESS_ERR_URB);
+
+static struct attribute *error_attrs[] = {
+  &dev_attr_busy.attr,
+  &dev_attr_unplugged.attr,
+  &dev_attr_short_transfer.attr,
+  &dev_attr_urb.attr,
+  NULL,
+};
+
+static const struct attribute_group error_group = {
+  .name =	"errors",
+  .attrs =	error_attrs,
+};
+
+/* cypress_driver.dev_groups: the driver core adds them with the interface's
+ * binding, before udev hears of it, and removes them on unbind */
+const struct attribute_group *cypress_dev_groups[] = {
+  &error_group,
+  NULL,
+};
+
+/**
+ * cypress_stats_add_board - create the debugfs directory for one board
+ */
+void cypress_stats_add_board(struct usb_cypress *dev)
+{
+  char name[MAX_SERIAL_LENGTH + 1];
+
+  snprintf(name, sizeof(name), "%d", dev->boardSerialNum);
+  dev->debugfs_dir = debugfs_create_dir(name, cypress_debugfs_root);
+  debugfs_create_file("read_latency", 0444, dev->debugfs_dir, &dev->read_hist, &hist_fops);
+  debugfs_create_file("write_latency", 0444, dev->debugfs_dir, &dev->write_hist, &hist_fops);
+  debugfs_create_file("reset", 0200, dev->debugfs_dir, dev, &reset_fops);
+  debugfs_create_ulong("mailbox_coalesced", 0444, dev->debugfs_dir, &dev->mailbox_coalesced);
+  debugfs_create_ulong("cycle_overruns", 0444, dev->debugfs_dir, &dev->cycle_overruns);
+}
+
+/**
+ * cypress_stats_remove_board - remove a board's debugfs directory.  Waits
+ * for any open debugfs file operation to finish.
+ */
+void cypress_stats_remove_board(struct usb_cypress *dev)
+{
+  debugfs_remove_recursive(dev->debugfs_dir);
+  dev->debugfs_dir = NULL;
+}
+
+void cypress_stats_init(void)
+{
+  cypress_debugfs_root = debugfs_create_dir("brl_usb", NULL);
+}
+
+void cypress_stats_exit(void)
+{
+  debugfs_remove_recursive(cypress_debugfs_root);
+}
@@ -6,55 +6,254 @@
  */
 
 #include "bulk_cypress.h"
+#include "brl_usb_trace.h"
 
-extern struct usb_cypress_node USBBoards[];
 
 /**
- *    cypress_write
+ * cypress_get_write_slot
+ *
+ * Claim an idle entry of the write queue, or NULL if all CYPRESS_WRITE_URBS
+ * are in flight.  Safe from any context.
  */
-ssize_t cypress_write(int serial, const char *buffer, size_t count) 
+static struct cypress_write_slot *cypress_get_write_slot(struct usb_cypress *dev)
 {
-  ssize_t bytes_written = 0;
-  int retval = 0;
-  struct usb_cypress *dev = NULL;
+  int i;
 
-  //Make sure the device is active
-  if (!USBBoards[serial].isActive)
+  for (i = 0; i < CYPRESS_WRITE_URBS; i++)
     {
-      printk(DRIVER_DESC ": Attempted to write to an invalid USB Board (%d)\n",serial);
-      return -EINVAL;
+      if (test_and_clear_bit(i, &dev->write_free))
+	{
+	  atomic_inc(&dev->write_busy);
+	  return &dev->write_slots[i];
+	}
     }
+  return NULL;
+}
 
-  dev = USBBoards[serial].data;
+/**
+ * cypress_put_write_slot
+ *
+ * Return a slot to the write queue and wake writers waiting for one.
+ */
+static void cypress_put_write_slot(struct cypress_write_slot *slot)
+{
+  struct usb_cypress *dev = slot->dev;
 
-  /* lock this object */
-  spin_lock(&dev->lock);
+  atomic_dec(&dev->write_busy);
+  /* the callback's stores to the slot must be visible before it can be
+   * claimed again; test_and_clear_bit() in the claimer is fully ordered */
+  smp_mb__before_atomic();
+  set_bit(slot->index, &dev->write_free);
+  wake_up_interruptible_poll(&dev->write_wait, EPOLLOUT | EPOLLWRNORM);
+}
+
+/**
+ * cypress_send_mailbox
+ *
+ * Copy the pending mailbox packet into slot and submit it.  Called with
+ * mailbox_lock held; on failure the slot is returned to the write queue
+ * and the packet stays pending for the next write or completion.
+ */
+static int cypress_send_mailbox(struct usb_cypress *dev, struct cypress_write_slot *slot)
+{
+  int retval;
+
+  memcpy(slot->urb->transfer_buffer, dev->mailbox, dev->mailbox_len);
+  slot->urb->transfer_buffer_length = dev->mailbox_len;
+  slot->mailbox = 1;
+  slot->done = NULL;
+  dev->mailbox_slot = slot;
+  dev->mailbox_pending = 0;
+  dev->write_actual_length = 0;
+
+  slot->submit_ns = ktime_get_ns();
+  retval = usb_submit_urb(slot->urb, GFP_ATOMIC);
+  trace_brl_usb_write_submit(dev->boardSerialNum, dev->mailbox_len, dev->mailbox[0], retval);
+  if (retval)
+    {
+      slot->mailbox = 0;
+      dev->mailbox_slot = NULL;
+      dev->mailbox_pending = 1;
+      cypress_put_write_slot(slot);
+    }
+  return retval;
+}
+
+/**
+ * cypress_mailbox_complete
+ *
+ * Called by the write callback once slot is done.  If a mailbox packet is
+ * pending and no other urb is carrying the mailbox, slot is reused to send
+ * it straight away.
+ *
+ *  result - true iff slot was taken over and must not be put back.
+ */
+static int cypress_mailbox_complete(struct usb_cypress *dev, struct cypress_write_slot *slot, int status)
+{
+  unsigned long flags;
+  int reused = 0;
+
+  spin_lock_irqsave(&dev->mailbox_lock, flags);
+  if (slot->mailbox)
+    {
+      slot->mailbox = 0;
+      dev->mailbox_slot = NULL;
+    }
+  /* don't resubmit urbs that are being killed or a device that is gone */
+  if (dev->mailbox_pending && dev->mailbox_slot == NULL && dev->present &&
+      status != -ENOENT && status != -ECONNRESET && status != -ESHUTDOWN)
+    {
+      /* the slot stays claimed; cypress_send_mailbox() puts it back on failure */
+      cypress_send_mailbox(dev, slot);
+      reused = 1;
+    }
+  spin_unlock_irqrestore(&dev->mailbox_lock, flags);
+  return reused;
+}
+
+/**
+ * cypress_alloc_write_slots
+ *
+ * Allocate the OUT urbs of the write queue, each with its own coherent
+ * buffer of bulk_out_size bytes, so back-to-back writes never wait on one
+ * another's buffer.  Called from probe once bulk_out_endpointAddr is known.
+ *
+ *  result - 0 on success, -ENOMEM on failure; cypress_free_write_slots()
+ *           cleans up a partial allocation.
+ */
+int cypress_alloc_write_slots(struct usb_cypress *dev)
+{
+  struct cypress_write_slot *slot;
+  unsigned char *buffer;
+  int i;
+
+  for (i = 0; i < CYPRESS_WRITE_URBS; i++)
+    {
+      slot = &dev->write_slots[i];
+      slot->dev = dev;
+      slot->index = i;
+      slot->urb = usb_alloc_urb(0, GFP_KERNEL);
+      if (slot->urb == NULL)
+	return -ENOMEM;
+
+      /* on some platforms using this kind of buffer alloc
+       * call eliminates a dma "bounce buffer".
+       */
+      buffer = usb_alloc_coherent(dev->udev, dev->bulk_out_size, GFP_KERNEL,
+				  &slot->urb->transfer_dma);
+      if (buffer == NULL)
+	return -ENOMEM;
+
+      usb_fill_bulk_urb(slot->urb, dev->udev,
+			usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+			buffer, dev->bulk_out_size,
+			(usb_complete_t)cypress_write_bulk_callback, slot);
+      slot->urb->transfer_flags = (URB_NO_TRANSFER_DMA_MAP);
+      set_bit(i, &dev->write_free);
+    }
+  return 0;
+}
+
+/**
+ * cypress_free_write_slots
+ */
+void cypress_free_write_slots(struct usb_cypress *dev)
+{
+  struct cypress_write_slot *slot;
+  int i;
+
+  for (i = 0; i < CYPRESS_WRITE_URBS; i++)
+    {
+      slot = &dev->write_slots[i];
+      if (slot->urb == NULL)
+	continue;
+      if (slot->urb->transfer_buffer)
+	usb_free_coherent(dev->udev, dev->bulk_out_size,
+			  slot->urb->transfer_buffer, slot->urb->transfer_dma);
+      usb_free_urb(slot->urb);
+      slot->urb = NULL;
+    }
+  dev->write_free = 0;
+}
+
+/**
+ * cypress_kill_writes
+ *
+ * Cancel every queued write and wait for the callbacks to finish.
+ * Must be called from process context.
+ */
+void cypress_kill_writes(struct usb_cypress *dev)
+{
+  int i;
+
+  for (i = 0; i < CYPRESS_WRITE_URBS; i++)
+    if (dev->write_slots[i].urb)
+      usb_kill_urb(dev->write_slots[i].urb);
+}
+
+/**
+ * cypress_write_ready
+ *
+ *  result - true iff a write would be accepted without waiting.
+ */
+int cypress_write_ready(struct usb_cypress *dev)
+{
+  return READ_ONCE(dev->write_free) != 0;
+}
+
+/**
+ * cypress_wait_write
+ *
+ * Sleep until a slot of the write queue is idle or the device goes away.
+ *
+ *  result - 0 when a write may be attempted, -ERESTARTSYS on a signal.
+ */
+int cypress_wait_write(struct usb_cypress *dev)
+{
+  return wait_event_interruptible(dev->write_wait,
+				  cypress_write_ready(dev) || !dev->present);
+}
+
+/**
+ *    cypress_queue_write
+ *
+ * Queue count bytes on the next idle write urb.  Up to CYPRESS_WRITE_URBS
+ * writes may be in flight; the host controller sends them in order.  buffer
+ * is copied before returning, so the caller may reuse it at once.
+ *
+ * If done is given it is called from the completion handler, in interrupt
+ * context, with ctx, the urb status and the number of bytes sent.
+ *
+ *  result - bytes queued, or -EBUSY if the whole queue is in flight.
+ *  -EBUSY is not counted here, since the caller may wait and retry;
+ *  callers that give up count it as CYPRESS_ERR_BUSY.
+ */
+ssize_t cypress_queue_write(struct usb_cypress *dev, const char *buffer, size_t count,
+			    cypress_done_t done, void *ctx)
+{
+  ssize_t bytes_written = 0;
+  int retval = 0;
+  int serial = dev->boardSerialNum;
+  struct cypress_write_slot *slot;
 
   /* verify that the device wasn't unplugged */
   if (!dev->present) {
-    printk(DRIVER_DESC ": Device unplugged (board %d)\n", serial);
-    retval = -ENODEV;
-    goto exit;
+    cypress_error(dev, CYPRESS_ERR_UNPLUGGED, "Device unplugged (board %d)\n", serial);
+    return -ENODEV;
   }
 
   /* verify that we actually have some data to write */
   if (count == 0) {
     dbg("%s - write request of 0 bytes", __FUNCTION__);
-    retval = -EINVAL;
-    goto exit;
+    return -EINVAL;
   }
 
-  /* wait for a previous write to finish up; we don't use a timeout
-   * and so a nonresponsive device can delay us indefinitely.
+  /* take an idle urb off the write queue; the caller may wait for
+   * one with cypress_wait_write() if they are all in flight.
    */
-  if (atomic_read(&dev->write_busy)){
-    printk(DRIVER_DESC ": Write already in progress (board %d)\n", serial);
-    retval= -EBUSY;
-    goto exit;
-  }
-
-  /* send the data out the bulk port */
-  atomic_set (&dev->write_busy, 1);
+  slot = cypress_get_write_slot(dev);
+  if (slot == NULL)
+    return -EBUSY;
 
   /* we can only write as much as our buffer will hold */
   bytes_written = min (dev->bulk_out_size, count);
@@ -62,59 +261,436 @@ ssize_t cypress_write(int serial, const char *buffer, size_t count)
   /* copy the data from buffer into our transfer buffer;
    * this is the only copy required.
    */
-  memcpy(dev->write_urb->transfer_buffer, buffer, bytes_written);
-
-  usb_cypress_debug_data(__FUNCTION__, bytes_written, dev->write_urb->transfer_buffer);
+  memcpy(slot->urb->transfer_buffer, buffer, bytes_written);
 
   /* this urb was already set up, except for this write size */
-  dev->write_urb->transfer_buffer_length = bytes_written;
+  slot->urb->transfer_buffer_length = bytes_written;
+  slot->done = done;
+  slot->done_ctx = ctx;
   dev->write_actual_length = 0;
 
-  /* disable IRQs  */
-  //disable_irq_nosync(0);
-
   /* a character device write uses GFP_KERNEL,
      unless a spinlock is held */
-  retval = usb_submit_urb(dev->write_urb, GFP_ATOMIC);
-
-  /* renable irqs */
-  //enable_irq(0);
-
+  slot->submit_ns = ktime_get_ns();
+  retval = usb_submit_urb(slot->urb, GFP_ATOMIC);
+  trace_brl_usb_write_submit(serial, bytes_written, buffer[0], retval);
 
   if( retval )
     {
-      printk(DRIVER_DESC ": Failed submitting write urb, error %d (board %d)\n",retval, serial);
-      // re-init urb?
-      atomic_set (&dev->write_busy, 0);
+      cypress_error(dev, CYPRESS_ERR_URB, "Failed submitting write urb, error %d (board %d)\n",retval, serial);
+      slot->done = NULL;
+      cypress_put_write_slot(slot);
     }
   else
     {
       retval = bytes_written;
     }
 
- exit:
-  spin_unlock(&dev->lock);    /* unlock the device */
   return retval;
 }
 
+/**
+ *    cypress_write
+ *
+ * cypress_queue_write() by board serial number.
+ */
+ssize_t cypress_write(int serial, const char *buffer, size_t count) 
+{
+  struct usb_cypress *dev = NULL;
+  ssize_t retval;
+
+  //Make sure the device is active
+  rcu_read_lock();
+  dev = cypress_find_board(serial);
+  if (dev == NULL)
+    {
+      rcu_read_unlock();
+      cypress_log("Attempted to write to an invalid USB Board (%d)\n",serial);
+      return -EINVAL;
+    }
+
+  retval = cypress_queue_write(dev, buffer, count, NULL, NULL);
+  if (retval == -EBUSY)
+    atomic_long_inc(&dev->errors[CYPRESS_ERR_BUSY]);
+  rcu_read_unlock();
+  return retval;
+}
+
+/**
+ *    cypress_queue_mailbox
+ *
+ * Latest-value write for setpoints such as DAC_WRITE.  buffer replaces the
+ * board's mailbox packet.  If no mailbox packet is on the bus it is sent at
+ * once, otherwise the completion of the one in flight sends whatever is
+ * newest by then, so stale commands are dropped instead of queued and the
+ * caller never waits.  Safe from any context.
+ *
+ *  result - bytes accepted, or a negative error code.
+ */
+ssize_t cypress_queue_mailbox(struct usb_cypress *dev, const char *buffer, size_t count)
+{
+  struct cypress_write_slot *slot;
+  unsigned long flags;
+  ssize_t retval;
+
+  if (count == 0)
+    return -EINVAL;
+
+  spin_lock_irqsave(&dev->mailbox_lock, flags);
+
+  if (!dev->present) {
+    atomic_long_inc(&dev->errors[CYPRESS_ERR_UNPLUGGED]);
+    retval = -ENODEV;
+    goto unlock;
+  }
+
+  retval = min (dev->bulk_out_size, count);
+  if (dev->mailbox_pending)
+    dev->mailbox_coalesced++;
+  memcpy(dev->mailbox, buffer, retval);
+  dev->mailbox_len = retval;
+  dev->mailbox_pending = 1;
+
+  /* the urb in flight picks the new packet up when it completes; with the
+   * whole write queue busy, the next completion of any write does. */
+  if (dev->mailbox_slot == NULL)
+    {
+      slot = cypress_get_write_slot(dev);
+      if (slot)
+	{
+	  int err = cypress_send_mailbox(dev, slot);
+
+	  if (err)
+	    {
+	      cypress_error(dev, CYPRESS_ERR_URB, "Failed submitting mailbox urb, error %d (board %d)\n",
+			    err, dev->boardSerialNum);
+	      retval = err;
+	    }
+	}
+    }
+
+ unlock:
+  spin_unlock_irqrestore(&dev->mailbox_lock, flags);
+  return retval;
+}
+
+/**
+ *    cypress_write_mailbox
+ *
+ * cypress_queue_mailbox() by board serial number.
+ */
+ssize_t cypress_write_mailbox(int serial, const char *buffer, size_t count)
+{
+  struct usb_cypress *dev;
+  ssize_t retval;
+
+  rcu_read_lock();
+  dev = cypress_find_board(serial);
+  if (dev == NULL)
+    {
+      rcu_read_unlock();
+      cypress_log("Attempted to write to an invalid USB Board (%d)\n",serial);
+      return -EINVAL;
+    }
+
+  retval = cypress_queue_mailbox(dev, buffer, count);
+  rcu_read_unlock();
+  return retval;
+}
+
+/**
+ * cypress_repeat_mailbox
+ *
+ * Send the newest mailbox packet again, even if it already went out, so a
+ * board sees its setpoint every cycle.  Called from the cycle engine's
+ * timer; does nothing before the first mailbox write, and leaves the
+ * packet pending if a mailbox urb is still on the bus or the write queue
+ * is full.
+ */
+void cypress_repeat_mailbox(struct usb_cypress *dev)
+{
+  struct cypress_write_slot *slot;
+  unsigned long flags;
+
+  spin_lock_irqsave(&dev->mailbox_lock, flags);
+  if (dev->mailbox_len && dev->present)
+    {
+      dev->mailbox_pending = 1;
+      if (dev->mailbox_slot == NULL)
+	{
+	  slot = cypress_get_write_slot(dev);
+	  if (slot)
+	    cypress_send_mailbox(dev, slot);
+	}
+    }
+  spin_unlock_irqrestore(&dev->mailbox_lock, flags);
+}
+
 /**
  *	cypress_write_bulk_callback
  */
 void cypress_write_bulk_callback (struct urb *urb, struct pt_regs *regs)
 {
-  struct usb_cypress *dev = (struct usb_cypress *)urb->context;
+  struct cypress_write_slot *slot = (struct cypress_write_slot *)urb->context;
+  struct usb_cypress *dev = slot->dev;
+  int status = urb->status;
+  int chain_read = slot->chain_read;
+  cypress_done_t done = slot->done;
+  void *done_ctx = slot->done_ctx;
+  size_t actual_length = urb->actual_length;   /* the slot may be resubmitted below */
+  struct cypress_stamp stamp;
+  unsigned long flags;
+
+  cypress_stamp_now(dev, &stamp);
+  trace_brl_usb_write_complete(dev->boardSerialNum, urb->actual_length,
+			       ((u8 *)urb->transfer_buffer)[0], status);
 
   /* sync/async unlink faults aren't errors */
-  if (urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET))
+  if (status && !(status == -ENOENT || status == -ECONNRESET))
     {
-      dbg("%s - nonzero write bulk status received: %d", __FUNCTION__, urb->status);
+      dbg("%s - nonzero write bulk status received: %d", __FUNCTION__, status);
+      atomic_long_inc(&dev->errors[CYPRESS_ERR_URB]);
     }
+  else if (status == 0 && urb->actual_length < urb->transfer_buffer_length)
+    atomic_long_inc(&dev->errors[CYPRESS_ERR_SHORT]);
+  if (status == 0)
+    cypress_hist_add(&dev->write_hist, stamp.ns - slot->submit_ns);
 
   /* update write_actual_length with the number of bytes read */
+  write_seqlock_irqsave(&dev->out_stamp_lock, flags);
   dev->write_actual_length = urb->actual_length;
+  if (status == 0)
+    dev->out_stamp = stamp;
+  write_sequnlock_irqrestore(&dev->out_stamp_lock, flags);
+  if (slot->exchange && status == 0)
+    dev->exchange_stamp = stamp;      /* read by the owner of read_urb */
+
+  /* hand the slot back, or on to a pending mailbox packet, and notify
+   * anyone waiting for one */
+  slot->chain_read = 0;
+  slot->exchange = 0;
+  slot->done = NULL;
+  if (!cypress_mailbox_complete(dev, slot, status))
+    cypress_put_write_slot(slot);
 
-  /* notify anyone waiting that the write has finished */
-  atomic_set (&dev->write_busy, 0);
+  /* second half of a write-then-read exchange */
+  if (chain_read)
+    cypress_chain_read(dev, status);
+
+  if (done)
+    done(done_ctx, status, actual_length);
+}
+
+/**
+ * cypress_submit_exchange
+ *
+ * Start a write-then-read transaction on one board.  out is queued on a
+ * write urb and its callback submits the read urb as soon as the OUT
+ * packet has completed, so the reply lands in in without another trip
+ * through userspace.  Writes already queued go out first.  Wait for the
+ * reply with cypress_wait_read() and abandon it with
+ * cypress_cancel_exchange(); in must stay valid until the read urb has
+ * completed or been killed.
+ *
+ * If anchor is given, both urbs are instead anchored to it and submitted
+ * back to back, so several boards can be exchanged together and waited for
+ * with usb_wait_anchor_empty_timeout().
+ *
+ * With in == NULL the reply is appended to the packet ring instead; the
+ * cycle engine uses this from its timer.  Other exchanges are refused while
+ * the ring is active.  Takes no lock, so it is safe from any context.
+ *
+ * done, if given, is called once the reply is in or the exchange failed,
+ * as for cypress_submit_read(); it is not called if this returns an error.
+ *
+ *  result - 0 on success, negative error code on failure.
+ */
+int cypress_submit_exchange(struct usb_cypress *dev, const char *out, size_t out_len, char *in, size_t in_len,
+			    struct usb_anchor *anchor, cypress_done_t done, void *ctx)
+{
+  int retval = 0;
+  int old;
+  struct cypress_write_slot *slot;
+
+  if (!dev->present) {
+    atomic_long_inc(&dev->errors[CYPRESS_ERR_UNPLUGGED]);
+    retval = -ENODEV;
+    goto exit;
+  }
+
+  if (out_len == 0 || in_len == 0) {
+    retval = -EINVAL;
+    goto exit;
+  }
+
+  /* claim the read urb; it is submitted by the write callback.  The ring
+   * check comes after the claim, see cypress_claim_read() */
+  old = cypress_read_claim(dev);
+  if (old < 0) {
+    retval = -EBUSY;
+    goto busy;
+  }
+  if (in != NULL && cypress_ring_active(dev)) {
+    cypress_read_unclaim(dev, old);
+    retval = -EBUSY;
+    goto busy;
+  }
+
+  slot = cypress_get_write_slot(dev);
+  if (slot == NULL) {
+    cypress_read_unclaim(dev, old);
+    retval = -EBUSY;
+    goto busy;
+  }
+  dev->exchange_slot = slot;
+  slot->done = NULL;
+  slot->exchange = 1;
+  memset(&dev->exchange_stamp, 0, sizeof(dev->exchange_stamp));
+  dev->read_done = done;
+  dev->read_done_ctx = ctx;
+
+  dev->read_urb->transfer_buffer_length = min(dev->bulk_in_size, in_len);
+  dev->rt_buffer = in;
+  dev->read_to_ring = (in == NULL);
+  dev->read_actual_length = 0;
+
+  out_len = min(dev->bulk_out_size, out_len);
+  memcpy(slot->urb->transfer_buffer, out, out_len);
+  slot->urb->transfer_buffer_length = out_len;
+  dev->write_actual_length = 0;
+
+  if (anchor == NULL)
+    {
+      slot->chain_read = 1;
+      slot->submit_ns = ktime_get_ns();
+      retval = usb_submit_urb(slot->urb, GFP_ATOMIC);
+      trace_brl_usb_write_submit(dev->boardSerialNum, out_len, out[0], retval);
+      if (retval)
+	{
+	  cypress_error(dev, CYPRESS_ERR_URB, "Failed submitting exchange urb, error %d (board %d)\n",
+			retval, dev->boardSerialNum);
+	  slot->chain_read = 0;
+	  slot->exchange = 0;
+	  dev->read_done = NULL;
+	  cypress_put_write_slot(slot);
+	  cypress_read_unclaim(dev, old);
+	}
+      goto exit;
+    }
+
+  usb_anchor_urb(slot->urb, anchor);
+  slot->submit_ns = ktime_get_ns();
+  retval = usb_submit_urb(slot->urb, GFP_ATOMIC);
+  trace_brl_usb_write_submit(dev->boardSerialNum, out_len, out[0], retval);
+  if (retval)
+    {
+      cypress_error(dev, CYPRESS_ERR_URB, "Failed submitting exchange urb, error %d (board %d)\n",
+		    retval, dev->boardSerialNum);
+      usb_unanchor_urb(slot->urb);
+      slot->exchange = 0;
+      dev->read_done = NULL;
+      cypress_put_write_slot(slot);
+      cypress_read_unclaim(dev, old);
+      goto exit;
+    }
+
+  usb_anchor_urb(dev->read_urb, anchor);
+  dev->read_submit_ns = ktime_get_ns();
+  retval = usb_submit_urb(dev->read_urb, GFP_ATOMIC);
+  trace_brl_usb_read_submit(dev->boardSerialNum, dev->read_urb->transfer_buffer_length, 0, retval);
+  if (retval)
+    {
+      /* the write is already on its way; the caller kills the anchor */
+      cypress_error(dev, CYPRESS_ERR_URB, "Failed submitting exchange urb, error %d (board %d)\n",
+		    retval, dev->boardSerialNum);
+      usb_unanchor_urb(dev->read_urb);
+      dev->read_done = NULL;
+      dev->read_actual_length = 0;
+      dev->read_status = retval;
+      atomic_cmpxchg_release(&dev->read_state, CYPRESS_URB_SUBMITTED, CYPRESS_URB_COMPLETED);
+    }
+  goto exit;
+
+ busy:
+  atomic_long_inc(&dev->errors[CYPRESS_ERR_BUSY]);
+ exit:
+  return retval;
+}
+
+/* cypress_board_exchange_done - read_done of a cypress_board_exchange() */
+static void cypress_board_exchange_done(void *ctx, int status, size_t actual_length)
+{
+  struct usb_cypress *dev = ctx;
+  cypress_done_t done = dev->board_done;
+  void *done_ctx = dev->board_done_ctx;
+
+  /* the reply goes to done, not to a later read(); let go of read_urb
+   * first so done can submit the next exchange */
+  cypress_read_consume(dev);
+  cmpxchg(&dev->read_owner, dev, NULL);
+  done(done_ctx, status, actual_length);
+}
+
+/**
+ * cypress_board_exchange
+ *
+ * In-kernel write-then-read for clients holding a cypress_get_board()
+ * reference.  done(ctx, status, actual_length) is called from the read
+ * completion once in holds the reply, or with an error if the exchange
+ * failed or was cancelled, so a controller can run its loop at callback
+ * time without polling cypress_get_bytes_read().  done runs in interrupt
+ * context and may submit the next exchange; in must stay valid until it
+ * has been called.
+ *
+ * The exchange owns read_urb, like an open file between ioctl(4) and its
+ * read(), so it never replaces a reply a file has not collected yet.
+ *
+ *  result - 0 if done will be called, negative error code otherwise
+ *           (-EBUSY while a file or the last exchange holds read_urb, or
+ *           the board is streaming or cycling).
+ */
+int cypress_board_exchange(struct usb_cypress *dev, const char *out, size_t out_len,
+			   char *in, size_t in_len, cypress_done_t done, void *ctx)
+{
+  int retval;
+
+  if (in == NULL || done == NULL)
+    return -EINVAL;
+  if (cmpxchg(&dev->read_owner, NULL, dev) != NULL) {
+    atomic_long_inc(&dev->errors[CYPRESS_ERR_BUSY]);
+    return -EBUSY;
+  }
+
+  dev->board_done = done;
+  dev->board_done_ctx = ctx;
+  retval = cypress_submit_exchange(dev, out, out_len, in, in_len, NULL,
+				   cypress_board_exchange_done, dev);
+  if (retval)
+    cmpxchg(&dev->read_owner, dev, NULL);
+  return retval;
+}
+
+/**
+ * cypress_cancel_exchange
+ *
+ * Kill both halves of the last exchange started on dev.  read_urb is
+ * poisoned while the write is killed, so the write callback cannot chain a
+ * read that is then left behind.  Must be called
+ * from process context by the owner of the exchange.
+ */
+void cypress_cancel_exchange(struct usb_cypress *dev)
+{
+  struct cypress_write_slot *slot = READ_ONCE(dev->exchange_slot);
+
+  /* The write callback clears chain_read before it chains the read, so
+   * poison read_urb first: a chain racing with us then fails instead of
+   * landing in a buffer the caller is about to free.  Poisoning counts,
+   * so this does not undo the poison of a disconnect. */
+  usb_poison_urb(dev->read_urb);
+  /* once chain_read has cleared the slot may carry someone else's write */
+  if (slot && READ_ONCE(slot->chain_read))
+    usb_kill_urb(slot->urb);
+  usb_unpoison_urb(dev->read_urb);
 }
 
 /**
@@ -132,15 +708,18 @@ void cypress_write_bulk_callback (struct urb *urb, struct pt_regs *regs)
  */
 ssize_t  cypress_get_bytes_written(int serialNum)
 {
+  struct usb_cypress *dev;
+  ssize_t bytes_written = -ENODEV;
+
   // Check if the board as active
-  if( USBBoards[serialNum].isActive == TRUE )
-    {
-      return USBBoards[serialNum].data->write_actual_length; 
-    }
-  else
+  rcu_read_lock();
+  dev = cypress_find_board(serialNum);
+  if( dev != NULL )
     {
-      return -ENODEV;
+      bytes_written = dev->write_actual_length; 
     }
+  rcu_read_unlock();
+  return bytes_written;
 }
 
 